@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include "cachedisk.h"
+
+//points of each disk on the ring
+#define CD_VNODES 128
+//I/O errors in a row that take a disk out of rotation
+#define CD_MAX_ERRORS 3
+//seconds between probes of a disk out of rotation
+#define CD_PROBE_SECS 10
+//written by the probe, hidden and internal so the index scan skips it
+#define CD_PROBE_FILE ".~probe"
+//the workers take turns between request I/O and background work (scan, probe),
+//this much time at a time
+#define CD_QUANTUM_US 1000
+#define CD_BACKGROUND_KEY 0
+#define CD_REQUEST_KEY 1
+
+/**
+ * create_cache_disks creates a disk for each root.
+ */
+cache_disks* create_cache_disks(const char** roots, int num_roots, int io_threads){
+  int i;
+
+  cache_disks* cd = (cache_disks*) calloc(1, sizeof(cache_disks));
+  if(cd == NULL){
+    perror("malloc");
+    return NULL;
+  }
+
+  cd->num_disks = num_roots;
+  cd->disks = (cache_disk*) calloc(num_roots, sizeof(cache_disk));
+  if(cd->disks == NULL){
+    perror("malloc");
+    free(cd);
+    return NULL;
+  }
+
+  for(i=0; i < num_roots; i++){
+    cache_disk* d = &cd->disks[i];
+
+    //"/cache/" and "/cache" are the same disk, and the same ring points
+    d->root = strdup(roots[i]);
+    size_t len = strlen(d->root);
+    while((len > 1) && (d->root[len - 1] == '/')){
+      d->root[--len] = '\0';
+    }
+
+    d->cd = cd;
+    d->io = create_fair_threadpool(io_threads, CD_QUANTUM_US);
+    if(d->io == NULL){
+      return NULL;
+    }
+  }
+
+  //ring points are placed by the cleaned up roots
+  const char** names = (const char**) malloc(sizeof(char*) * num_roots);
+  if(names == NULL){
+    perror("malloc");
+    return NULL;
+  }
+  for(i=0; i < num_roots; i++){
+    names[i] = cd->disks[i].root;
+  }
+  cd->ring = create_hashring(names, num_roots, CD_VNODES);
+  free(names);
+  if(cd->ring == NULL){
+    return NULL;
+  }
+
+  return cd;
+}
+
+cache_disk* cache_disk_of(cache_disks* cd, const char* key){
+  const int node = hashring_lookup(cd->ring, key);
+  return (node == -1) ? NULL : &cd->disks[node];
+}
+
+cache_disk* cache_disk_path(cache_disks* cd, const char* key, char* fpath, size_t size){
+  cache_disk* d = cache_disk_of(cd, key);
+  if(d == NULL){
+    return NULL;
+  }
+
+  if((size_t) snprintf(fpath, size, "%s/%s", d->root, key) >= size){
+    return NULL;
+  }
+  return d;
+}
+
+static int cd_op(void* arg){
+  cache_disk_op* op = (cache_disk_op*) arg;
+
+  const int rv = op->fn(op->arg);
+
+  //the op is gone once its waiter sees done
+  pthread_mutex_lock(&op->lock);
+  op->rv = rv;
+  op->done = 1;
+  pthread_cond_signal(&op->cond);
+  pthread_mutex_unlock(&op->lock);
+
+  return rv;
+}
+
+void cache_disk_submit(cache_disk* d, cache_disk_op* op, int (*fn)(void*), void* arg){
+  op->fn = fn;
+  op->arg = arg;
+  op->rv = -1;
+  op->done = 0;
+  pthread_mutex_init(&op->lock, NULL);
+  pthread_cond_init(&op->cond, NULL);
+
+  dispatch_keyed(d->io, cd_op, op, CD_REQUEST_KEY);
+}
+
+int cache_disk_wait(cache_disk_op* op){
+  pthread_mutex_lock(&op->lock);
+  while(!op->done){
+    pthread_cond_wait(&op->cond, &op->lock);
+  }
+  pthread_mutex_unlock(&op->lock);
+
+  pthread_mutex_destroy(&op->lock);
+  pthread_cond_destroy(&op->cond);
+  return op->rv;
+}
+
+int cache_disk_run(cache_disk* d, int (*fn)(void*), void* arg){
+  cache_disk_op op;
+
+  cache_disk_submit(d, &op, fn, arg);
+  return cache_disk_wait(&op);
+}
+
+/**
+ * try a write on a disk out of rotation, until it works again.
+ * runs on the disk's own workers, so it holds up no other disk.
+ */
+static int cd_probe(void* arg){
+  cache_disk* d = (cache_disk*) arg;
+  cache_disks* cd = d->cd;
+  const char probe[] = "probe";
+  char path[PATH_MAX];
+  int secs;
+
+  snprintf(path, sizeof(path), "%s/%s", d->root, CD_PROBE_FILE);
+
+  while(1){
+    //sleep in steps, so shutdown doesn't wait a whole period
+    for(secs=0; (secs < CD_PROBE_SECS) && !__sync_fetch_and_add(&cd->shutdown, 0); secs++){
+      sleep(1);
+    }
+    if(__sync_fetch_and_add(&cd->shutdown, 0)){
+      break;
+    }
+
+    const int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if(fd == -1){
+      continue;
+    }
+    const int ok = (write(fd, probe, sizeof(probe)) == sizeof(probe)) && (fsync(fd) == 0);
+    close(fd);
+    unlink(path);
+
+    if(ok){
+      __sync_lock_test_and_set(&d->errors, 0);
+      hashring_set_up(cd->ring, d - cd->disks, 1);
+      printf("Cache disk %s: back in rotation\n", d->root);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * cache_disk_error counts a failed I/O on a disk.
+ */
+void cache_disk_error(cache_disk* d, int err){
+  cache_disks* cd = d->cd;
+
+  //only errors that say the disk is broken or full
+  if( (err != EIO) && (err != EROFS) && (err != ENOSPC) &&
+      (err != EDQUOT) && (err != ENODEV) && (err != ENXIO) ){
+    return;
+  }
+
+  //the error that reaches the limit takes the disk out, once
+  if(__sync_add_and_fetch(&d->errors, 1) == CD_MAX_ERRORS){
+    hashring_set_up(cd->ring, d - cd->disks, 0);
+    __sync_add_and_fetch(&d->failures, 1);
+    fprintf(stderr, "Cache disk %s: out of rotation: %s\n", d->root, strerror(err));
+    dispatch_keyed(d->io, cd_probe, d, CD_BACKGROUND_KEY);
+  }
+}
+
+void cache_disk_ok(cache_disk* d){
+  //a disk out of rotation comes back only through its probe
+  if(hashring_is_up(d->cd->ring, d - d->cd->disks)){
+    __sync_lock_test_and_set(&d->errors, 0);
+  }
+}
+
+/**
+ * destroy_cache_disks stops the I/O workers and frees the disks.
+ */
+void destroy_cache_disks(cache_disks* cd){
+  int i;
+
+  //probes see this and return, so the pools can drain
+  __sync_lock_test_and_set(&cd->shutdown, 1);
+
+  for(i=0; i < cd->num_disks; i++){
+    cache_disk* d = &cd->disks[i];
+    destroy_threadpool(d->io);
+    printf("Cache disk %s: %s, out of rotation %lu times\n", d->root,
+           hashring_is_up(cd->ring, i) ? "up" : "down", d->failures);
+    free(d->root);
+  }
+
+  destroy_hashring(cd->ring);
+  free(cd->disks);
+  free(cd);
+}
@@ -0,0 +1,93 @@
+#ifndef CACHEDISK_H
+#define CACHEDISK_H
+
+#include <pthread.h>
+#include "hashring.h"
+#include "threadpool.h"
+
+typedef struct cache_disk_st {
+  char * root;            //cache directory on this disk
+  threadpool * io;        //I/O workers of this disk
+  int errors;             //I/O errors in a row
+  unsigned long failures; //times taken out of rotation
+  struct cache_disks_st * cd;
+} cache_disk;
+
+/**
+ * a job on the I/O workers of a disk, that its caller waits for.
+ * it lives on the caller's stack until cache_disk_wait returns.
+ */
+typedef struct cache_disk_op_st {
+  int (*fn)(void*);
+  void * arg;
+  int rv;                 //what fn returned
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} cache_disk_op;
+
+/**
+ * the cache roots, and the ring that spreads keys over them.
+ * a disk that keeps failing is taken out of the ring, and probed
+ * on its own workers until it works again.
+ */
+typedef struct cache_disks_st {
+  cache_disk * disks;
+  int num_disks;
+  hashring * ring;
+  int shutdown;
+} cache_disks;
+
+/**
+ * create_cache_disks creates a disk for each root, with io_threads
+ * I/O workers each. request I/O and background work (the index scan,
+ * probes) take turns for the workers.
+ * returns NULL on failure.
+ */
+cache_disks* create_cache_disks(const char** roots, int num_roots, int io_threads);
+
+/**
+ * cache_disk_of finds the disk a cache key is stored on.
+ * returns NULL if no disk is in rotation.
+ */
+cache_disk* cache_disk_of(cache_disks* cd, const char* key);
+
+/**
+ * cache_disk_path builds the path of a cache key on its disk.
+ * returns the disk, or NULL if no disk is in rotation or the path is too long.
+ */
+cache_disk* cache_disk_path(cache_disks* cd, const char* key, char* fpath, size_t size);
+
+/**
+ * cache_disk_submit starts fn(arg) on the I/O workers of a disk,
+ * ahead of background work queued there.
+ */
+void cache_disk_submit(cache_disk* d, cache_disk_op* op, int (*fn)(void*), void* arg);
+
+/**
+ * cache_disk_wait waits for a submitted op, and returns what its fn returned.
+ */
+int cache_disk_wait(cache_disk_op* op);
+
+/**
+ * cache_disk_run runs fn(arg) on the I/O workers of a disk, and waits for it.
+ */
+int cache_disk_run(cache_disk* d, int (*fn)(void*), void* arg);
+
+/**
+ * cache_disk_error counts a failed I/O with error err on a disk.
+ * errors that are not the disk's fault are ignored.
+ */
+void cache_disk_error(cache_disk* d, int err);
+
+/**
+ * cache_disk_ok counts a successful write on a disk.
+ */
+void cache_disk_ok(cache_disk* d);
+
+/**
+ * destroy_cache_disks stops the I/O workers and frees the disks.
+ */
+void destroy_cache_disks(cache_disks* cd);
+
+#endif
@@ -0,0 +1,666 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cacheindex.h"
+
+#define CI_MAGIC "PXYIDX1"
+#define CI_VERSION 1
+#define CI_MIN_BUCKETS 64
+
+//checkpoint file: header, fixed size records, then the keys
+typedef struct ci_file_hdr_st {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t strings_off;
+  uint64_t strings_len;
+} ci_file_hdr;
+
+typedef struct ci_file_rec_st {
+  uint64_t size;
+  int64_t mtime;
+  int64_t expires;
+  uint64_t hits;
+  uint64_t key_off;
+  uint32_t key_len;
+  uint32_t pad;
+} ci_file_rec;
+
+//a directory to scan, key is relative to its scan root
+typedef struct ci_scan_job_st {
+  struct ci_scan_st * scan;
+  int root;
+  char key[PATH_MAX];
+} ci_scan_job;
+
+typedef struct ci_scan_st {
+  cache_index * ci;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int outstanding;        //directories queued or being scanned
+  size_t files;
+} ci_scan;
+
+static uint64_t ci_hash(const char* key){
+  uint64_t h = 14695981039346656037ULL;  //FNV-1a
+  while(*key){
+    h ^= (unsigned char) *key++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static ci_stripe* ci_stripe_of(cache_index* ci, const uint64_t hash){
+  return &ci->stripes[hash % CI_STRIPES];
+}
+
+/**
+ * find an entry in a stripe, called with the stripe locked.
+ */
+static ci_entry* ci_find(ci_stripe* st, const char* key, const uint64_t hash){
+  ci_entry* e = st->buckets[(hash / CI_STRIPES) % st->num_buckets];
+  while(e){
+    if((e->hash == hash) && (strcmp(e->key, key) == 0)){
+      return e;
+    }
+    e = e->next;
+  }
+  return NULL;
+}
+
+/**
+ * double the buckets of a stripe, called with the stripe locked.
+ */
+static void ci_grow(ci_stripe* st){
+  const size_t num_buckets = st->num_buckets * 2;
+  size_t i;
+
+  ci_entry** buckets = (ci_entry**) calloc(num_buckets, sizeof(ci_entry*));
+  if(buckets == NULL){
+    return;   //keep the longer chains
+  }
+
+  for(i=0; i < st->num_buckets; i++){
+    ci_entry* e = st->buckets[i];
+    while(e){
+      ci_entry* next = e->next;
+      const size_t b = (e->hash / CI_STRIPES) % num_buckets;
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+
+  free(st->buckets);
+  st->buckets = buckets;
+  st->num_buckets = num_buckets;
+}
+
+/**
+ * add or update an entry. an existing entry is kept as is
+ * if only_new is set.
+ */
+static void ci_insert(cache_index* ci, const char* key, off_t size, time_t mtime,
+                      time_t expires, unsigned long hits, int only_new){
+  const uint64_t hash = ci_hash(key);
+  ci_stripe* st = ci_stripe_of(ci, hash);
+
+  pthread_mutex_lock(&st->lock);
+
+  ci_entry* e = ci_find(st, key, hash);
+  if(e){
+    if(!only_new){
+      e->size = size;
+      e->mtime = mtime;
+      e->expires = expires;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return;
+  }
+
+  e = (ci_entry*) malloc(sizeof(ci_entry));
+  if((e == NULL) || ((e->key = strdup(key)) == NULL)){
+    perror("malloc");
+    free(e);
+    pthread_mutex_unlock(&st->lock);
+    return;
+  }
+  e->hash = hash;
+  e->size = size;
+  e->mtime = mtime;
+  e->expires = expires;
+  e->hits = hits;
+
+  const size_t b = (hash / CI_STRIPES) % st->num_buckets;
+  e->next = st->buckets[b];
+  st->buckets[b] = e;
+
+  if(++st->num_entries > 2 * st->num_buckets){
+    ci_grow(st);
+  }
+
+  pthread_mutex_unlock(&st->lock);
+}
+
+static void* ci_saver_work(void* p);
+
+/**
+ * create_cache_index creates an empty index, checkpointed to path.
+ */
+cache_index* create_cache_index(const char* path, int checkpoint_secs){
+  int i;
+
+  cache_index* ci = (cache_index*) calloc(1, sizeof(cache_index));
+  if(ci == NULL){
+    perror("malloc");
+    return NULL;
+  }
+
+  for(i=0; i < CI_STRIPES; i++){
+    ci_stripe* st = &ci->stripes[i];
+    pthread_mutex_init(&st->lock, NULL);
+    st->num_buckets = CI_MIN_BUCKETS;
+    st->buckets = (ci_entry**) calloc(st->num_buckets, sizeof(ci_entry*));
+    if(st->buckets == NULL){
+      perror("malloc");
+      return NULL;
+    }
+  }
+
+  ci->path = strdup(path);
+  ci->checkpoint_secs = checkpoint_secs;
+  pthread_mutex_init(&ci->lock, NULL);
+  pthread_cond_init(&ci->wake, NULL);
+
+  if(checkpoint_secs > 0){
+    if(pthread_create(&ci->saver, NULL, ci_saver_work, (void*)ci) != 0){
+      perror("pthread_create");
+      ci->checkpoint_secs = 0;
+    }
+  }
+
+  return ci;
+}
+
+/**
+ * cache_index_load fills the index from its checkpoint file.
+ */
+int cache_index_load(cache_index* ci){
+  struct stat st;
+  uint32_t i;
+
+  const int fd = open(ci->path, O_RDONLY);
+  if(fd == -1){
+    return -1;
+  }
+
+  if((fstat(fd, &st) == -1) || ((size_t) st.st_size < sizeof(ci_file_hdr))){
+    close(fd);
+    return -1;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    perror("mmap");
+    return -1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  //validate, the file may be from a crash or another version.
+  //each offset is checked against the size before it's added to,
+  //so a corrupt one can't wrap around
+  const ci_file_hdr* hdr = (const ci_file_hdr*) map;
+  const ci_file_rec* recs = (const ci_file_rec*) &hdr[1];
+  if( (memcmp(hdr->magic, CI_MAGIC, sizeof(hdr->magic)) != 0) ||
+      (hdr->version != CI_VERSION) ||
+      (hdr->strings_off > (uint64_t) st.st_size) ||
+      (hdr->strings_len != (uint64_t) st.st_size - hdr->strings_off) ||
+      (sizeof(ci_file_hdr) + (uint64_t) hdr->count * sizeof(ci_file_rec) > hdr->strings_off) ){
+    fprintf(stderr, "Error: Invalid cache index %s\n", ci->path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  const char* strings = (const char*) map + hdr->strings_off;
+
+  //size the stripes up front, so loading doesn't rehash
+  for(i=0; i < CI_STRIPES; i++){
+    ci_stripe* s = &ci->stripes[i];
+    size_t want = hdr->count / CI_STRIPES / 2 + 1;
+    while(s->num_buckets < want){
+      ci_grow(s);
+    }
+  }
+
+  for(i=0; i < hdr->count; i++){
+    char key[PATH_MAX];
+    const ci_file_rec* r = &recs[i];
+
+    if( (r->key_off > hdr->strings_len) || (r->key_len > hdr->strings_len - r->key_off) ||
+        (r->key_len >= PATH_MAX) ){
+      continue;
+    }
+    memcpy(key, &strings[r->key_off], r->key_len);
+    key[r->key_len] = '\0';
+
+    ci_insert(ci, key, r->size, r->mtime, r->expires, r->hits, 1);
+  }
+
+  munmap(map, st.st_size);
+
+  pthread_mutex_lock(&ci->lock);
+  ci->ready = 1;
+  pthread_mutex_unlock(&ci->lock);
+
+  return 0;
+}
+
+static void ci_scan_queue(ci_scan* scan, const int root, const char* key);
+
+/**
+ * scan one directory, sub directories are queued as new jobs.
+ */
+static int ci_scan_dir(void* arg){
+  ci_scan_job* job = (ci_scan_job*) arg;
+  ci_scan* scan = job->scan;
+  char path[PATH_MAX * 2], key[PATH_MAX + NAME_MAX + 2];
+  struct dirent* de;
+  struct stat st;
+  size_t files = 0;
+
+  snprintf(path, sizeof(path), "%s/%s", scan->ci->scan_roots[job->root], job->key);
+
+  DIR* dir = opendir(path);
+  if(dir != NULL){
+    const int dfd = dirfd(dir);
+
+    while((de = readdir(dir)) != NULL){
+      //skip hidden files, and internal ones (variants, temporary)
+      if((de->d_name[0] == '.') || (strstr(de->d_name, ".~") != NULL)){
+        continue;
+      }
+
+      if(fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1){
+        continue;
+      }
+
+      snprintf(key, sizeof(key), "%s/%s", job->key, de->d_name);
+      if(strlen(key) >= PATH_MAX){
+        continue;
+      }
+
+      if(S_ISDIR(st.st_mode)){
+        ci_scan_queue(scan, job->root, key);
+      }else if(S_ISREG(st.st_mode)){
+        ci_insert(scan->ci, key, st.st_size, st.st_mtime, 0, 0, 1);
+        files++;
+      }
+    }
+    closedir(dir);
+  }
+
+  pthread_mutex_lock(&scan->lock);
+  scan->files += files;
+  if(--scan->outstanding == 0){
+    pthread_cond_signal(&scan->done);
+  }
+  pthread_mutex_unlock(&scan->lock);
+
+  free(job);
+  return 0;
+}
+
+static void ci_scan_queue(ci_scan* scan, const int root, const char* key){
+  ci_scan_job* job = (ci_scan_job*) malloc(sizeof(ci_scan_job));
+  if(job == NULL){
+    perror("malloc");
+    return;
+  }
+  job->scan = scan;
+  job->root = root;
+  snprintf(job->key, sizeof(job->key), "%s", key);
+
+  pthread_mutex_lock(&scan->lock);
+  scan->outstanding++;
+  pthread_mutex_unlock(&scan->lock);
+
+  dispatch(scan->ci->scan_pools[root], ci_scan_dir, job);
+}
+
+/**
+ * The work function of the scan thread, it runs the pool of each root
+ * over the host directories of that root.
+ */
+static void* ci_scanner_work(void* p){
+  cache_index* ci = (cache_index*) p;
+  struct dirent* de;
+  struct stat st;
+  ci_scan scan;
+  int i;
+
+  memset(&scan, 0, sizeof(scan));
+  scan.ci = ci;
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_cond_init(&scan.done, NULL);
+
+  for(i=0; i < ci->num_scan_roots; i++){
+    DIR* dir = opendir(ci->scan_roots[i]);
+    if(dir == NULL){
+      perror(ci->scan_roots[i]);
+      continue;
+    }
+    const int dfd = dirfd(dir);
+
+    //cache entries are all under a host directory
+    while((de = readdir(dir)) != NULL){
+      if((de->d_name[0] == '.') ||
+         (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) ||
+         !S_ISDIR(st.st_mode)){
+        continue;
+      }
+      ci_scan_queue(&scan, i, de->d_name);
+    }
+    closedir(dir);
+  }
+
+  //jobs queue more jobs, wait until all are done
+  pthread_mutex_lock(&scan.lock);
+  while(scan.outstanding > 0){
+    pthread_cond_wait(&scan.done, &scan.lock);
+  }
+  pthread_mutex_unlock(&scan.lock);
+
+  pthread_mutex_destroy(&scan.lock);
+  pthread_cond_destroy(&scan.done);
+
+  printf("Cache index: scanned %lu files in %d roots\n", scan.files, ci->num_scan_roots);
+
+  pthread_mutex_lock(&ci->lock);
+  ci->ready = 1;
+  pthread_mutex_unlock(&ci->lock);
+
+  return NULL;
+}
+
+/**
+ * cache_index_scan rebuilds the index from the files under the roots.
+ */
+int cache_index_scan(cache_index* ci, const char** roots, threadpool** pools, int num_roots){
+  int i;
+
+  ci->scan_roots = (char**) calloc(num_roots, sizeof(char*));
+  ci->scan_pools = (threadpool**) calloc(num_roots, sizeof(threadpool*));
+  if((ci->scan_roots == NULL) || (ci->scan_pools == NULL)){
+    perror("malloc");
+    return -1;
+  }
+  for(i=0; i < num_roots; i++){
+    ci->scan_roots[i] = strdup(roots[i]);
+    ci->scan_pools[i] = pools[i];
+  }
+  ci->num_scan_roots = num_roots;
+
+  if(pthread_create(&ci->scanner, NULL, ci_scanner_work, (void*)ci) != 0){
+    perror("pthread_create");
+    return -1;
+  }
+  ci->scanning = 1;
+
+  return 0;
+}
+
+void cache_index_put(cache_index* ci, const char* key, off_t size, time_t mtime, time_t expires){
+  ci_insert(ci, key, size, mtime, expires, 0, 0);
+}
+
+int cache_index_hit(cache_index* ci, const char* key){
+  const uint64_t hash = ci_hash(key);
+  ci_stripe* st = ci_stripe_of(ci, hash);
+
+  pthread_mutex_lock(&st->lock);
+  ci_entry* e = ci_find(st, key, hash);
+  if(e){
+    e->hits++;
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  return (e != NULL);
+}
+
+int cache_index_get(cache_index* ci, const char* key, ci_entry* out){
+  const uint64_t hash = ci_hash(key);
+  ci_stripe* st = ci_stripe_of(ci, hash);
+
+  pthread_mutex_lock(&st->lock);
+  ci_entry* e = ci_find(st, key, hash);
+  if(e){
+    *out = *e;
+    out->key = NULL;
+    out->next = NULL;
+  }
+  pthread_mutex_unlock(&st->lock);
+
+  return (e != NULL);
+}
+
+void cache_index_remove(cache_index* ci, const char* key){
+  const uint64_t hash = ci_hash(key);
+  ci_stripe* st = ci_stripe_of(ci, hash);
+
+  pthread_mutex_lock(&st->lock);
+
+  ci_entry** pe = &st->buckets[(hash / CI_STRIPES) % st->num_buckets];
+  while(*pe){
+    ci_entry* e = *pe;
+    if((e->hash == hash) && (strcmp(e->key, key) == 0)){
+      *pe = e->next;
+      st->num_entries--;
+      free(e->key);
+      free(e);
+      break;
+    }
+    pe = &e->next;
+  }
+
+  pthread_mutex_unlock(&st->lock);
+}
+
+void cache_index_stats(cache_index* ci, size_t* entries, uint64_t* bytes){
+  size_t i, b;
+
+  *entries = 0;
+  *bytes = 0;
+
+  for(i=0; i < CI_STRIPES; i++){
+    ci_stripe* st = &ci->stripes[i];
+
+    pthread_mutex_lock(&st->lock);
+    *entries += st->num_entries;
+    for(b=0; b < st->num_buckets; b++){
+      ci_entry* e;
+      for(e = st->buckets[b]; e; e = e->next){
+        *bytes += e->size;
+      }
+    }
+    pthread_mutex_unlock(&st->lock);
+  }
+}
+
+/**
+ * cache_index_save writes the checkpoint file.
+ * it's written to a temporary file and renamed, so a crash
+ * leaves the previous checkpoint.
+ */
+int cache_index_save(cache_index* ci){
+  char tmppath[PATH_MAX];
+  ci_file_hdr hdr;
+  ci_file_rec* recs = NULL;
+  char* strings = NULL;
+  size_t num_recs = 0, recs_size = 0;
+  size_t strings_len = 0, strings_size = 0;
+  size_t i, b;
+  int rv = 0;
+
+  //a partial index would hide the rest of the cache on next start
+  pthread_mutex_lock(&ci->lock);
+  const int ready = ci->ready;
+  pthread_mutex_unlock(&ci->lock);
+  if(!ready){
+    return -1;
+  }
+
+  //snapshot one stripe at a time
+  for(i=0; i < CI_STRIPES; i++){
+    ci_stripe* st = &ci->stripes[i];
+
+    pthread_mutex_lock(&st->lock);
+    for(b=0; b < st->num_buckets; b++){
+      ci_entry* e;
+      for(e = st->buckets[b]; e; e = e->next){
+        const size_t key_len = strlen(e->key);
+
+        if(num_recs >= recs_size){
+          recs_size = recs_size ? recs_size * 2 : 1024;
+          recs = (ci_file_rec*) realloc(recs, sizeof(ci_file_rec) * recs_size);
+        }
+        while(strings_len + key_len > strings_size){
+          strings_size = strings_size ? strings_size * 2 : 64*1024;
+          strings = (char*) realloc(strings, strings_size);
+        }
+        if((recs == NULL) || (strings == NULL)){
+          perror("realloc");
+          pthread_mutex_unlock(&st->lock);
+          free(recs);
+          free(strings);
+          return -1;
+        }
+
+        ci_file_rec* r = &recs[num_recs++];
+        memset(r, 0, sizeof(ci_file_rec));
+        r->size = e->size;
+        r->mtime = e->mtime;
+        r->expires = e->expires;
+        r->hits = e->hits;
+        r->key_off = strings_len;
+        r->key_len = key_len;
+
+        memcpy(&strings[strings_len], e->key, key_len);
+        strings_len += key_len;
+      }
+    }
+    pthread_mutex_unlock(&st->lock);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CI_MAGIC, sizeof(hdr.magic));
+  hdr.version = CI_VERSION;
+  hdr.count = num_recs;
+  hdr.strings_off = sizeof(hdr) + num_recs * sizeof(ci_file_rec);
+  hdr.strings_len = strings_len;
+
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", ci->path);
+  FILE* fp = fopen(tmppath, "w");
+  if(fp == NULL){
+    perror("fopen");
+    rv = -1;
+  }else{
+    if( (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+        (fwrite(recs, sizeof(ci_file_rec), num_recs, fp) != num_recs) ||
+        (fwrite(strings, 1, strings_len, fp) != strings_len) ){
+      perror("fwrite");
+      rv = -1;
+    }
+    if(fclose(fp) != 0){
+      rv = -1;
+    }
+
+    if((rv == 0) && (rename(tmppath, ci->path) == -1)){
+      perror("rename");
+      rv = -1;
+    }
+    if(rv == -1){
+      unlink(tmppath);
+    }
+  }
+
+  free(recs);
+  free(strings);
+  return rv;
+}
+
+/**
+ * The work function of the checkpoint thread
+ */
+static void* ci_saver_work(void* p){
+  cache_index* ci = (cache_index*) p;
+  struct timespec ts;
+
+  pthread_mutex_lock(&ci->lock);
+  while(!ci->shutdown){
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ci->checkpoint_secs;
+
+    if((pthread_cond_timedwait(&ci->wake, &ci->lock, &ts) == ETIMEDOUT) && !ci->shutdown){
+      pthread_mutex_unlock(&ci->lock);
+      cache_index_save(ci);
+      pthread_mutex_lock(&ci->lock);
+    }
+  }
+  pthread_mutex_unlock(&ci->lock);
+
+  return NULL;
+}
+
+/**
+ * destroy_cache_index stops the threads, writes a last checkpoint
+ * and frees the index.
+ */
+void destroy_cache_index(cache_index* ci){
+  size_t i, b;
+
+  if(ci->scanning){
+    pthread_join(ci->scanner, NULL);
+  }
+
+  if(ci->checkpoint_secs > 0){
+    pthread_mutex_lock(&ci->lock);
+    ci->shutdown = 1;
+    pthread_cond_signal(&ci->wake);
+    pthread_mutex_unlock(&ci->lock);
+    pthread_join(ci->saver, NULL);
+  }
+
+  cache_index_save(ci);
+
+  for(i=0; i < CI_STRIPES; i++){
+    ci_stripe* st = &ci->stripes[i];
+    for(b=0; b < st->num_buckets; b++){
+      ci_entry* e = st->buckets[b];
+      while(e){
+        ci_entry* next = e->next;
+        free(e->key);
+        free(e);
+        e = next;
+      }
+    }
+    free(st->buckets);
+    pthread_mutex_destroy(&st->lock);
+  }
+
+  pthread_mutex_destroy(&ci->lock);
+  pthread_cond_destroy(&ci->wake);
+  for(i=0; i < (size_t) ci->num_scan_roots; i++){
+    free(ci->scan_roots[i]);
+  }
+  free(ci->scan_roots);
+  free(ci->scan_pools);
+  free(ci->path);
+  free(ci);
+}
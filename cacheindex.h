@@ -0,0 +1,110 @@
+#ifndef CACHEINDEX_H
+#define CACHEINDEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "threadpool.h"
+
+//the table is split in stripes, each with its own lock
+#define CI_STRIPES 64
+
+typedef struct ci_entry_st {
+  char * key;             //cache path, relative to its cache root
+  uint64_t hash;
+  off_t size;
+  time_t mtime;
+  time_t expires;         //0 if unknown
+  unsigned long hits;
+  struct ci_entry_st * next;
+} ci_entry;
+
+typedef struct ci_stripe_st {
+  pthread_mutex_t lock;
+  ci_entry ** buckets;
+  size_t num_buckets;
+  size_t num_entries;
+} ci_stripe;
+
+typedef struct cache_index_st {
+  ci_stripe stripes[CI_STRIPES];
+  char * path;            //checkpoint file
+  int ready;              //index covers the whole cache
+
+  //checkpoint thread
+  pthread_t saver;
+  int checkpoint_secs;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int shutdown;
+
+  //warm start scan
+  pthread_t scanner;
+  int scanning;
+  char ** scan_roots;
+  threadpool ** scan_pools; //workers of each root
+  int num_scan_roots;
+} cache_index;
+
+/**
+ * create_cache_index creates an empty index, checkpointed to path
+ * every checkpoint_secs (0 for only on destroy).
+ * returns NULL on failure.
+ */
+cache_index* create_cache_index(const char* path, int checkpoint_secs);
+
+/**
+ * cache_index_load fills the index from its checkpoint file.
+ * returns 0 on success, -1 if there is no usable checkpoint.
+ */
+int cache_index_load(cache_index* ci);
+
+/**
+ * cache_index_scan rebuilds the index from the files under the roots,
+ * in the background. each root is scanned on its own threadpool,
+ * which must outlive the index.
+ * entries added meanwhile are kept.
+ */
+int cache_index_scan(cache_index* ci, const char** roots, threadpool** pools, int num_roots);
+
+/**
+ * cache_index_put adds or updates an entry, keeping its hit count.
+ */
+void cache_index_put(cache_index* ci, const char* key, off_t size, time_t mtime, time_t expires);
+
+/**
+ * cache_index_hit counts a hit on an entry.
+ * returns 1 if the entry is known, 0 if not.
+ */
+int cache_index_hit(cache_index* ci, const char* key);
+
+/**
+ * cache_index_get copies an entry, without its key.
+ * returns 1 if found, 0 if not.
+ */
+int cache_index_get(cache_index* ci, const char* key, ci_entry* out);
+
+/**
+ * cache_index_remove drops an entry.
+ */
+void cache_index_remove(cache_index* ci, const char* key);
+
+/**
+ * cache_index_stats counts entries and their bytes.
+ */
+void cache_index_stats(cache_index* ci, size_t* entries, uint64_t* bytes);
+
+/**
+ * cache_index_save writes the checkpoint file.
+ * returns 0 on success, -1 on failure.
+ */
+int cache_index_save(cache_index* ci);
+
+/**
+ * destroy_cache_index stops the threads, writes a last checkpoint
+ * and frees the index.
+ */
+void destroy_cache_index(cache_index* ci);
+
+#endif
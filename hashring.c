@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashring.h"
+
+/**
+ * FNV-1a, then mixed (murmur3 finalizer) so similar strings,
+ * like "host/a" and "host/b", land far apart on the ring.
+ */
+uint64_t hashring_hash(const char* key){
+  uint64_t h = 14695981039346656037ULL;
+  while(*key){
+    h ^= (unsigned char) *key++;
+    h *= 1099511628211ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static int hr_point_cmp(const void* a, const void* b){
+  const hr_point* pa = (const hr_point*) a;
+  const hr_point* pb = (const hr_point*) b;
+
+  if(pa->hash != pb->hash){
+    return (pa->hash < pb->hash) ? -1 : 1;
+  }
+  return pa->node - pb->node;
+}
+
+/**
+ * create_hashring creates a ring of num_nodes nodes, all up.
+ */
+hashring* create_hashring(const char** names, int num_nodes, int vnodes){
+  char name[512];
+  int i, j;
+
+  if((num_nodes <= 0) || (vnodes <= 0)){
+    fprintf(stderr, "Error: Invalid hash ring\n");
+    return NULL;
+  }
+
+  hashring* r = (hashring*) calloc(1, sizeof(hashring));
+  if(r == NULL){
+    perror("malloc");
+    return NULL;
+  }
+
+  r->num_nodes = num_nodes;
+  r->num_points = num_nodes * vnodes;
+  r->points = (hr_point*) malloc(sizeof(hr_point) * r->num_points);
+  r->up = (int*) malloc(sizeof(int) * num_nodes);
+  if((r->points == NULL) || (r->up == NULL)){
+    perror("malloc");
+    free(r->points);
+    free(r->up);
+    free(r);
+    return NULL;
+  }
+
+  for(i=0; i < num_nodes; i++){
+    r->up[i] = 1;
+    for(j=0; j < vnodes; j++){
+      snprintf(name, sizeof(name), "%s#%d", names[i], j);
+      r->points[i * vnodes + j].hash = hashring_hash(name);
+      r->points[i * vnodes + j].node = i;
+    }
+  }
+
+  qsort(r->points, r->num_points, sizeof(hr_point), hr_point_cmp);
+
+  return r;
+}
+
+/**
+ * hashring_lookup finds the node owning key, skipping nodes that are down.
+ */
+int hashring_lookup(hashring* r, const char* key){
+  const uint64_t hash = hashring_hash(key);
+  int lo = 0, hi = r->num_points, i;
+
+  //first point at or after the hash
+  while(lo < hi){
+    const int mid = lo + (hi - lo) / 2;
+    if(r->points[mid].hash < hash){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+
+  //walk clockwise to a node that is up, wrapping at the end
+  for(i=0; i < r->num_points; i++){
+    const int node = r->points[(lo + i) % r->num_points].node;
+    if(hashring_is_up(r, node)){
+      return node;
+    }
+  }
+  return -1;
+}
+
+void hashring_set_up(hashring* r, int node, int up){
+  __sync_lock_test_and_set(&r->up[node], up ? 1 : 0);
+}
+
+int hashring_is_up(hashring* r, int node){
+  return __sync_fetch_and_add(&r->up[node], 0);
+}
+
+/**
+ * destroy_hashring frees the ring.
+ */
+void destroy_hashring(hashring* r){
+  free(r->points);
+  free(r->up);
+  free(r);
+}
@@ -0,0 +1,60 @@
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <stdint.h>
+
+//a virtual node, a point on the ring owned by a node
+typedef struct hr_point_st {
+  uint64_t hash;
+  int node;
+} hr_point;
+
+/**
+ * consistent hash ring. each node owns vnodes points, a key goes to
+ * the node of the first point at or after its hash. adding a node
+ * only moves the keys of the points it takes, about 1/N of them.
+ */
+typedef struct hashring_st {
+  hr_point * points;      //sorted by hash
+  int num_points;
+  int num_nodes;
+  int * up;               //node takes keys
+} hashring;
+
+/**
+ * hashring_hash hashes a string, the same way the ring places keys.
+ */
+uint64_t hashring_hash(const char* key);
+
+/**
+ * create_hashring creates a ring of num_nodes nodes, all up.
+ * points are placed by the node names, so a node keeps its keys
+ * whatever its position in names.
+ * returns NULL on failure.
+ */
+hashring* create_hashring(const char** names, int num_nodes, int vnodes);
+
+/**
+ * hashring_lookup finds the node owning key, skipping nodes that
+ * are down, their keys go to the next node on the ring.
+ * returns the node, or -1 if all nodes are down.
+ */
+int hashring_lookup(hashring* r, const char* key);
+
+/**
+ * hashring_set_up puts a node in or out of rotation.
+ * safe to call while other threads look keys up.
+ */
+void hashring_set_up(hashring* r, int node, int up);
+
+/**
+ * hashring_is_up returns 1 if the node takes keys.
+ */
+int hashring_is_up(hashring* r, int node);
+
+/**
+ * destroy_hashring frees the ring.
+ */
+void destroy_hashring(hashring* r);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <unistd.h>
@@ -13,68 +14,380 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <time.h>
+#include <zlib.h>
 
 #include "threadpool.h"
+#include "timerwheel.h"
+#include "relay.h"
+#include "cacheindex.h"
+#include "cachedisk.h"
+#include "hashring.h"
+#include "ratelimit.h"
+
+//size of the buffers used to move bodies between sockets and files
+#define COPY_BUF_SIZE (64*1024)
+
+//compressed variants are stored next to the identity body, with this suffix
+#define GZIP_SUFFIX ".~gz"
+//files smaller than this are not worth compressing
+#define GZIP_MIN_SIZE 1024
+#define GZIP_LEVEL 6
+//CPU budget for compression: threads, niceness and queued jobs
+#define GZIP_THREADS 1
+#define GZIP_NICE 10
+#define GZIP_MAX_PENDING 64
+
+//timer wheel resolution
+#define TIMER_TICK_MS 10
+//I/O deadlines, in milliseconds
+#define HEADER_TIMEOUT     10000    //whole request header, from its first byte
+#define CONNECT_TIMEOUT     5000    //connect to origin
+#define FIRST_BYTE_TIMEOUT 30000    //origin reply header
+#define BODY_IDLE_TIMEOUT  30000    //no progress in a body transfer
+#define KEEPALIVE_TIMEOUT  15000    //idle connection between requests
+#define KEEPALIVE_CHECK_MS   200    //an idle connection checks this often if others wait for its worker
+#define TUNNEL_IDLE_TIMEOUT 300000  //CONNECT tunnel with no traffic
+
+//cache index checkpoint, rebuilt by a scan of the cache roots when there is none
+#define INDEX_FILE ".cache_index"
+#define INDEX_CHECKPOINT_SECS 60
+
+//cache roots, one per disk, and I/O workers of each disk
+#define MAX_CACHE_DISKS 32
+#define DISK_IO_THREADS 4
+
+//happy eyeballs: delay between connection attempts, and max addresses tried
+#define CONNECT_ATTEMPT_DELAY 250
+#define MAX_CONNECT_ADDRS 16
+
+//sibling proxies: points of each on the ring, seconds a failed peer is skipped,
+//and the header that marks a request from a peer, so it's never forwarded again
+#define MAX_PEERS 32
+#define PEER_VNODES 64
+#define PEER_RETRY_SECS 30
+#define PEER_HEADER "X-Proxy-Peer"
+//addresses of a peer, the requests it marks as its own are not limited as a client's
+#define MAX_PEER_ADDRS 8
+
+//fairness between clients: pool time a client gets on each turn, and with -r,
+//the bucket sizes, the share of a network (/24 or /64) in clients, how long idle
+//buckets are kept, and the longest nap when pacing a reply
+#define POOL_QUANTUM_US 10000
+#define REQ_BURST_SECS 2
+#define BYTE_BURST_SECS 1
+#define NET_CLIENTS 8
+#define LIMIT_IDLE_SECS 60
+#define PACE_MAX_SLEEP_MS 1000
+
+//upstream reply header, from the status line to the empty line
+#define REPLY_HDR_SIZE (4*1024)
+
+//client connection buffer, holds pipelined requests
+#define CONN_BUF_SIZE (16*1024)
+//max requests in flight on one connection
+#define PIPELINE_DEPTH 8
+//fetcher threads, misses of all connections fetched at once. when
+//they are all busy, a miss is fetched on its connection's own thread
+#define FETCH_THREADS 32
 
 struct arguments {
     int port;
     int pool_size;
     int max_requests;
     const char * filter;
+    const char * roots[MAX_CACHE_DISKS];
+    int num_roots;
+    const char * peers[MAX_PEERS];
+    int num_peers;
+    const char * self;      //our own name in peers
+    double req_rate;        //requests per second of a client, 0 for no limit
+    double byte_rate;       //reply bytes per second of a client, 0 for no limit
+};
+
+//IPv4 or IPv6 network
+struct net {
+    int family;
+    unsigned char addr[16];
+    int prefix;     //network bits
 };
 
 struct filter {
     char ** hosts;
     size_t num_hosts;
 
-    in_addr_t * ips;
-    size_t num_ips;
+    struct net * nets;
+    size_t num_nets;
+};
+
+//A sibling proxy, it's asked for the misses it owns on the ring
+struct peer {
+    char host[NI_MAXHOST];
+    char port[8];
+    char name[NI_MAXHOST + 8];  //host:port, as given on command line
+    long down_until;            //skipped until then, after a failure
+    struct net addrs[MAX_PEER_ADDRS];   //its host, resolved at startup
+    int num_addrs;
+};
+
+struct peers {
+    struct peer * list;
+    int num;
+    int self;                   //our own entry, never asked
+    hashring * ring;
+    unsigned long asked, failed;
+};
+
+struct compressor {
+    threadpool * tp;
+    int pending;    //jobs queued or running
+};
+
+struct fetchers {
+    threadpool * tp;
+    int busy;       //fetches running
+};
+
+enum timeout_kind {
+    TO_HEADER,
+    TO_CONNECT,
+    TO_FIRST_BYTE,
+    TO_BODY_IDLE,
+    TO_KEEPALIVE,
+    TO_KINDS
+};
+
+static const char * timeout_names[TO_KINDS] = {
+    "header", "connect", "first-byte", "body-idle", "keep-alive"
 };
 
+static const int timeout_ms[TO_KINDS] = {
+    HEADER_TIMEOUT, CONNECT_TIMEOUT, FIRST_BYTE_TIMEOUT, BODY_IDLE_TIMEOUT, KEEPALIVE_TIMEOUT
+};
+
+struct timeouts {
+    timerwheel * tw;
+    unsigned long expired[TO_KINDS];    //expiries of each deadline
+};
+
+//Deadline on a socket, the socket is shut down when it expires
+typedef struct io_timer_st {
+    tw_timer timer;
+    int sd;
+    enum timeout_kind kind;
+    struct timeouts * to;
+} io_timer_t;
+
 typedef struct dispatch_st {
     int sd;
-    struct sockaddr_in inaddr;
+    struct sockaddr_storage inaddr;
     const struct filter * filt;
+    struct compressor * comp;
+    struct fetchers * fetch;
+    struct timeouts * to;
+    relay * rl;
+    cache_index * idx;
+    cache_disks * disks;
+    struct peers * peers;   //NULL if not in peer mode
+    ratelimit * limits;     //NULL if clients are not limited
+    threadpool * tp;        //pool the connection runs on
 } dispatch_t;
 
-//Send an error reply over a socket
-static void err_reply(const int sd, const int code, const char * hdr, const char * msg){
+//A reply slot in the per-connection response queue
+typedef struct response_st {
+    char hname[NI_MAXHOST];
+    char pname[PATH_MAX];
+    char port[8];
+    int tunnel;         //CONNECT request
+    int http11;         //request was HTTP/1.1
+    int keep_alive;     //connection stays open after this reply
+    int accept_gzip;    //client accepts gzip encoding
+    int gzip;           //fd is the gzip variant
+    int fd;             //body to send, -1 if none
+    int code;           //reply status
+    char reason[64];
+    const char * msg;   //error message, NULL if not an error reply
+    char ctype[128];
+    char * hdrs;        //end-to-end headers of the upstream reply, NULL if none
+    int fetching;       //fetch runs on a fetcher thread, cleared when it's done with the slot
+    struct fetchers * fetch;
+    struct compressor * comp;
+    struct timeouts * to;
+    cache_index * idx;
+    cache_disks * disks;
+    struct peers * peers;
+    int from_peer;      //request came from a peer, it goes to origin
+    int via_peer;       //fetched from a peer, not from origin
+    ratelimit * limits;
+    const struct sockaddr_storage * client;
+    time_t expires;     //freshness from origin, 0 if unknown
+
+    //body progress, shared with fetcher thread
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int hdr_ready;      //status and length are known
+    int done;           //body is complete, or fetch failed
+    int failed;         //fetch failed after reply started
+    off_t length;       //body length, -1 if unknown
+    off_t avail;        //body bytes written to fd
+} response_t;
+
+//How the end of a message body is found
+enum framing {
+    BODY_NONE,      //no body
+    BODY_LENGTH,    //Content-Length bytes
+    BODY_CHUNKED,   //Transfer-Encoding: chunked
+    BODY_CLOSE      //until connection is closed
+};
+
+//Decoder for a message body, read from a socket
+typedef struct body_st {
+    int sd;
+    enum framing framing;
+    off_t left;         //bytes left in body, or in current chunk
+    int in_chunk;       //chunk data was read, CRLF follows
+    int end;            //last chunk was read
+    size_t pos, len;    //buffered bytes, not decoded yet
+    char buf[COPY_BUF_SIZE];
+} body_t;
+
+typedef struct gzip_job_st {
+    char fpath[PATH_MAX];
+    struct compressor * comp;
+} gzip_job_t;
+
+//A body being saved to cache, its file I/O runs on the workers of its disk
+typedef struct cache_file_st {
+    response_t * rsp;
+    cache_disk * disk;
+    char key[PATH_MAX];
+    char fpath[PATH_MAX];
+    char tmppath[PATH_MAX + 32];
+    int fd;
+    const char * buf;   //buffer being written
+    ssize_t len;
+    int err;            //-1 once the body can't be kept
+} cache_file_t;
+
+//Deadline expired, unblock whoever is waiting on the socket
+static void io_timeout(void * arg){
+    io_timer_t * t = (io_timer_t *) arg;
+
+    __sync_add_and_fetch(&t->to->expired[t->kind], 1);
+    shutdown(t->sd, SHUT_RDWR);
+}
+
+//Start (or restart) a deadline on a socket
+static void io_arm(io_timer_t * t, const enum timeout_kind kind){
+    t->kind = kind;
+    timer_add(t->to->tw, &t->timer, timeout_ms[kind], io_timeout, t);
+}
+
+//Stop a deadline, returns 0 if it already expired
+static int io_disarm(io_timer_t * t){
+    return timer_cancel(t->to->tw, &t->timer);
+}
 
-    const size_t cont_len = snprintf(NULL, 0,
-                                     "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD><BODY><H4>%d %s</H4>%s.</BODY></HTML>",
-                                     code, hdr, code, hdr, msg);
+static void io_timer_init(io_timer_t * t, const int sd, struct timeouts * to){
+    memset(t, 0, sizeof(io_timer_t));
+    t->sd = sd;
+    t->to = to;
+}
 
-    dprintf(sd, "HTTP/1.0 %d %s\r\n", code, hdr);
-    dprintf(sd, "Content-Type: text/html\r\n");
-    dprintf(sd, "Content-Length: %lu\r\n", cont_len);
-    dprintf(sd, "Connection: closed\r\n\r\n");
-    dprintf(sd, "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD><BODY><H4>%d %s</H4>%s.</BODY></HTML>",
-            code, hdr, code, hdr, msg);
+//Send an error reply over a socket
+static void err_reply(const int sd, const int code, const char * hdr, const char * msg){
+    char body[512], reply[1024];
+
+    const int cont_len = snprintf(body, sizeof(body),
+                                  "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD><BODY><H4>%d %s</H4>%s.</BODY></HTML>",
+                                  code, hdr, code, hdr, msg);
+
+    //build the whole reply, so its sent with one syscall
+    const int len = snprintf(reply, sizeof(reply),
+                             "HTTP/1.0 %d %s\r\n"
+                             "Content-Type: text/html\r\n"
+                             "Content-Length: %d\r\n"
+                             "Connection: closed\r\n\r\n"
+                             "%s", code, hdr, cont_len, body);
+
+    if(send(sd, reply, len, MSG_NOSIGNAL) == -1){
+        perror("send");
+    }
 }
 
 //Read HTTP reqeust
 static int read_headers(const int sd, char * buf, const size_t buf_size){
     size_t i = 0;
 
-    while(recv(sd, &buf[i], 1, 0) > 0){
+    //leave space for the terminating null
+    while(i < buf_size - 1){
+
+        //peek at queued data, so we don't consume anything past the headers
+        const ssize_t n = recv(sd, &buf[i], buf_size - 1 - i, MSG_PEEK);
+        if(n <= 0){
+            break;
+        }
+
+        //search for request end, it may start in previous read
+        size_t take = n;
+        size_t j = (i >= 3) ? i - 3 : 0;
+        for(; j + 4 <= i + n; j++){
+            if(strncmp(&buf[j], "\r\n\r\n", 4) == 0){
+                take = j + 4 - i;
+                break;
+            }
+        }
 
-        if(++i >= buf_size){  //if buffer is full
+        //consume only the bytes we keep
+        if(recv(sd, &buf[i], take, 0) != (ssize_t) take){
             break;
         }
+        i += take;
 
         //if we have the request end
-        if((i >=4) && (strncmp(&buf[i - 4], "\r\n\r\n", 4) == 0)){
+        if((i >= 4) && (strncmp(&buf[i - 4], "\r\n\r\n", 4) == 0)){
             break;
         }
     }
 
-    buf[i-1] = '\0';
+    buf[i] = '\0';
 
     return i;
 }
 
+//Mark reply as an error
+static void set_error(response_t * rsp, const int code, const char * reason, const char * msg){
+    rsp->code = code;
+    snprintf(rsp->reason, sizeof(rsp->reason), "%s", reason);
+    rsp->msg = msg;
+}
+
+//Remove port, and brackets of IPv6 literal, from host[:port]
+static void strip_port(char * host){
+    char * end;
+
+    if(host[0] == '['){  //[::1]:8080
+        end = strchr(host, ']');
+        if(end){
+            end[0] = '\0';
+            memmove(host, &host[1], strlen(&host[1]) + 1);
+        }
+        return;
+    }
+
+    //a single colon separates the port, more is a bare IPv6 address
+    end = strchr(host, ':');
+    if(end && (strchr(&end[1], ':') == NULL)){
+        end[0] = '\0';
+    }
+}
+
 //Extract host
-static int is_legal(const int sd, const char * buf, const size_t buf_len, char hname[NI_MAXHOST], char pname[PATH_MAX]){
+static int is_legal(response_t * rsp, const char * buf, const size_t buf_len, char hname[NI_MAXHOST], char pname[PATH_MAX]){
     char * end, *save_ptr;
     size_t len = strchr(buf, '\r') - buf;
 
@@ -89,14 +402,15 @@ static int is_legal(const int sd, const char * buf, const size_t buf_len, char h
 
     if((method == NULL) || (uri == NULL) || (proto == NULL)){
         free(first);
-        err_reply(sd, 400, "Bad Request", "Bad Request");
+        set_error(rsp, 400, "Bad Request", "Bad Request");
         return -1;
     }
 
-    //must be a GET request
-    if(strcmp(method, "GET") != 0){
+    //must be a GET or CONNECT request
+    if( (strcmp(method, "GET") != 0) &&
+        (strcmp(method, "CONNECT") != 0) ){
         free(first);
-        err_reply(sd, 501, "Not Implemented", "Method is not supported");
+        set_error(rsp, 501, "Not Implemented", "Method is not supported");
         return -1;
     }
 
@@ -104,30 +418,48 @@ static int is_legal(const int sd, const char * buf, const size_t buf_len, char h
     if( (strcmp(proto, "HTTP/1.0") != 0) &&
         (strcmp(proto, "HTTP/1.1") != 0) ){
         free(first);
-        err_reply(sd, 400, "Bad Request", "Bad Request");
+        set_error(rsp, 400, "Bad Request", "Bad Request");
         return -1;
     }
+    rsp->http11 = (strcmp(proto, "HTTP/1.1") == 0);
+
+    if(strcmp(method, "CONNECT") == 0){  //CONNECT www.site.com:443 HTTP/1.1
+        end = strrchr(uri, ':');
+        if((end == NULL) || (atoi(&end[1]) <= 0) || (atoi(&end[1]) > 65535)){
+            free(first);
+            set_error(rsp, 400, "Bad Request", "Bad Request");
+            return -1;
+        }
+        end[0] = '\0';
 
-    if(uri[0] == '/'){  //GET /index.php HTTP/1.0
+        snprintf(rsp->port, sizeof(rsp->port), "%d", atoi(&end[1]));
+        strip_port(uri);
+        strncpy(hname, uri, NI_MAXHOST);
+        strncpy(pname, "/", PATH_MAX);
+        rsp->tunnel = 1;
+
+    }else if(uri[0] == '/'){  //GET /index.php HTTP/1.0
         strncpy(pname, uri, PATH_MAX);
 
         //get host from header line
         char * hosthdr = strstr(buf, "Host: ");
         if(hosthdr == NULL){
             free(first);
-            err_reply(sd, 400, "Bad Request", "Bad Request");
+            set_error(rsp, 400, "Bad Request", "Bad Request");
             return -1;
         }
 
         end = strchr(hosthdr, '\r');
         if(end == NULL){
             free(first);
-            err_reply(sd, 400, "Bad Request", "Bad Request");
+            set_error(rsp, 400, "Bad Request", "Bad Request");
             return -1;
         }
         end[0] = '\0';
 
         strncpy(hname, &hosthdr[6], NI_MAXHOST);
+        hname[NI_MAXHOST - 1] = '\0';
+        strip_port(hname);
 
     }else{  //GET http://www.site.com:80/index.html HTTP/1.0
         char * end;
@@ -139,13 +471,11 @@ static int is_legal(const int sd, const char * buf, const size_t buf_len, char h
         end = strchr(uri, '/'); //find end of hostname
         if(end){
             strncpy(pname, end, PATH_MAX);
-
             end[0] = '\0';
-            end = strchr(uri, ':');
-            if(end){
-                end[0] = '\0';
-            }
+        }else{
+            strncpy(pname, "/", PATH_MAX);
         }
+        strip_port(uri);
         strncpy(hname, uri, NI_MAXHOST);
     }
 
@@ -161,7 +491,7 @@ static int is_resolveable(const char * hname){
     /* Obtain address(es) matching host/port. */
     memset(&hints, 0, sizeof(hints));
 
-    hints.ai_family = AF_INET;        /* Allow IPv4 */
+    hints.ai_family = AF_UNSPEC;      /* Allow IPv4 and IPv6 */
     hints.ai_socktype = SOCK_STREAM;  /* TCP */
     hints.ai_flags = 0;
     hints.ai_protocol = 0;          /* Any protocol */
@@ -169,7 +499,6 @@ static int is_resolveable(const char * hname){
     s = getaddrinfo(hname, "80", &hints, &result);
     if (s != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        freeaddrinfo(result);           /* No longer needed */
         return -1;
     }
     freeaddrinfo(result);           /* No longer needed */
@@ -188,14 +517,54 @@ static int is_filtered_host(const char * hname, const struct filter * filt){
     return 0;
 }
 
+//Check if an address is in a network
+static int net_match(const struct net * net, const int family, const unsigned char * addr){
+    const int bytes = net->prefix / 8;
+    const int bits  = net->prefix % 8;
+
+    if(net->family != family){
+        return 0;
+    }
+
+    if(memcmp(net->addr, addr, bytes) != 0){
+        return 0;
+    }
+
+    if(bits){
+        const unsigned char mask = 0xFF << (8 - bits);
+        if((net->addr[bytes] & mask) != (addr[bytes] & mask)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//IP address of a socket address, IPv4 mapped addresses as IPv4, NULL if not IP
+static const unsigned char * ip_of(const struct sockaddr * sa, int * family){
+    if(sa->sa_family == AF_INET){
+        *family = AF_INET;
+        return (const unsigned char *) &((const struct sockaddr_in *) sa)->sin_addr;
+    }
+    if(sa->sa_family == AF_INET6){
+        const struct in6_addr * in6 = &((const struct sockaddr_in6 *) sa)->sin6_addr;
+        if(IN6_IS_ADDR_V4MAPPED(in6)){
+            *family = AF_INET;
+            return &in6->s6_addr[12];
+        }
+        *family = AF_INET6;
+        return in6->s6_addr;
+    }
+    return NULL;
+}
+
 static int is_filtered_ip(const char * hname, const struct filter * filt){
-    int s;
+    int s, rv = 0;
     struct addrinfo hints, *result, *rp;
 
     /* Obtain address(es) matching host/port. */
     memset(&hints, 0, sizeof(hints));
 
-    hints.ai_family = AF_INET;        /* Allow IPv4 */
+    hints.ai_family = AF_UNSPEC;      /* Allow IPv4 and IPv6 */
     hints.ai_socktype = SOCK_STREAM;  /* TCP */
     hints.ai_flags = 0;
     hints.ai_protocol = 0;          /* Any protocol */
@@ -206,34 +575,38 @@ static int is_filtered_ip(const char * hname, const struct filter * filt){
         return -1;
     }
 
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        if(rp->ai_family == AF_INET){
-            size_t i;
+    for (rp = result; (rp != NULL) && (rv == 0); rp = rp->ai_next) {
+        int family;
+        size_t i;
 
-            //that is the server IP address
-            struct sockaddr_in inaddr = *(struct sockaddr_in*) rp->ai_addr;
-            const in_addr_t ip_addr = inaddr.sin_addr.s_addr;
-
-            //check each ip network in filter
-            for(i=0; i < filt->num_ips; i++){
-                const in_addr_t mask = filt->ips[i];
+        //that is the server IP address, IPv4 mapped is checked against IPv4 networks
+        const unsigned char * addr = ip_of(rp->ai_addr, &family);
+        if(addr == NULL){
+            continue;
+        }
 
-                if((ip_addr & mask) == mask){
-                    return 1;
-                }
+        //check each ip network in filter
+        for(i=0; i < filt->num_nets; i++){
+            if(net_match(&filt->nets[i], family, addr)){
+                rv = 1;
+                break;
             }
         }
     }
     freeaddrinfo(result);           /* No longer needed */
 
-    return 0; //not filtered
+    return rv;
 }
 
 //Check if a host/ip is filtered
 static int is_filtered(const char * hname, const struct filter * filt){
 
 
-    if(!isdigit(hname[0])){  //if its not a digit
+    unsigned char addr[16];
+
+    //if its not an IP address
+    if( (inet_pton(AF_INET, hname, addr) != 1) &&
+        (inet_pton(AF_INET6, hname, addr) != 1) ){
         if(is_filtered_host(hname, filt) == 1){
             return 1;
         }
@@ -243,8 +616,8 @@ static int is_filtered(const char * hname, const struct filter * filt){
     return is_filtered_ip(hname, filt);
 }
 
-static int creat_cache_file(const char * hname, const char * pname){
-    char fpath[PATH_MAX];
+//Build cache key, based on hostname and URL path, it's relative to a cache root
+static void cache_path(const char * hname, const char * pname, char fpath[PATH_MAX]){
 
     if(strcmp(pname, "/") == 0){  //don't cache indexp pages
         //create the path
@@ -252,9 +625,22 @@ static int creat_cache_file(const char * hname, const char * pname){
     }else{
         snprintf(fpath, PATH_MAX, "%s%s", hname, pname);
     }
+}
+
+//Create the temporary cache file, it's renamed to fpath when complete
+//(runs on the I/O workers of its disk)
+static int creat_cache_file(void * arg){
+    cache_file_t * file = (cache_file_t *) arg;
+    cache_disk * d = file->disk;
+    char * fpath = file->fpath;
+    char gzpath[PATH_MAX + 8];
 
-    //create the path to file
-    char * delim = strchr(fpath, '/');
+    //drop compressed variant of previous body
+    snprintf(gzpath, sizeof(gzpath), "%s%s", fpath, GZIP_SUFFIX);
+    unlink(gzpath);
+
+    //create the path to file, below the root
+    char * delim = strchr(&fpath[strlen(d->root) + 1], '/');
     while(delim){ //if we have a directory
         //replace / with null, to end string temporarily
         delim[0] = '\0';
@@ -262,6 +648,8 @@ static int creat_cache_file(const char * hname, const char * pname){
         if(mkdir(fpath, 0770) == -1){
             if(errno != EEXIST){
                 perror("mkdir");
+                cache_disk_error(d, errno);
+                delim[0] = '/';
                 break;
             }
         }
@@ -272,302 +660,1769 @@ static int creat_cache_file(const char * hname, const char * pname){
         delim = strchr(delim + 1, '/');
     }
 
-    //create the file
-    int fd = open(fpath, O_CREAT | O_RDWR, 0764);
-    if(fd == -1){
+    file->fd = open(file->tmppath, O_CREAT | O_TRUNC | O_RDWR, 0764);
+    if(file->fd == -1){
         perror("open");
+        cache_disk_error(d, errno);
+        return -1;
     }
 
-    return fd;
+    return 0;
 }
 
-//Open a file from cache, based on hostname and URL path
-static int open_cache_file(const char * hname, const char * pname){
-    char fpath[PATH_MAX];
+//Path of a cache file on the disk that owns it, suffix picks a variant
+static cache_disk * disk_file_path(cache_disks * cd, const char * hname, const char * pname,
+                                   const char * suffix, char vpath[PATH_MAX + 8]){
+    char key[PATH_MAX], fpath[PATH_MAX];
 
-    if(strcmp(pname, "/") == 0){  //don't cache indexp pages
-        //create the path
-        snprintf(fpath, PATH_MAX, "%s/index.html", hname);
-    }else{
-        snprintf(fpath, PATH_MAX, "%s%s", hname, pname);
+    cache_path(hname, pname, key);
+    cache_disk * d = cache_disk_path(cd, key, fpath, sizeof(fpath));
+    if(d != NULL){
+        snprintf(vpath, PATH_MAX + 8, "%s%s", fpath, suffix);
     }
-
-    return open(fpath, O_RDONLY);
+    return d;
 }
 
-static int connect_to(const char * hname){
-    struct addrinfo hints, *result, *rp;
-    int s, sd = -1;
+//Open a cache file on the disk that owns it and stat it, suffix picks a variant
+static int open_disk_file(cache_disks * cd, const char * hname, const char * pname, const char * suffix, struct stat * st){
+    char vpath[PATH_MAX + 8];
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;        /* Allow IPv4 */
-    hints.ai_socktype = SOCK_STREAM; /* Datagram socket */
+    cache_disk * d = disk_file_path(cd, hname, pname, suffix, vpath);
+    if(d == NULL){
+        return -1;
+    }
 
-    s = getaddrinfo(hname, "80", &hints, &result);
-    if (s != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+    const int fd = open(vpath, O_RDONLY);
+    if(fd == -1){
+        cache_disk_error(d, errno);
+        return -1;
+    }
+    if(fstat(fd, st) == -1){
+        perror("fstat");
+        close(fd);
         return -1;
     }
+    return fd;
+}
 
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        sd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sd == -1){
-            continue;
-        }
+//Open a file from cache, based on hostname and URL path
+static int open_cache_file(cache_disks * cd, const char * hname, const char * pname, struct stat * st){
+    return open_disk_file(cd, hname, pname, "", st);
+}
 
-        if (connect(sd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break;                  /* Success */
+//A variant has the mtime of the identity body it was made from
+static int same_mtime(const struct stat * a, const struct stat * b){
+    return (a->st_mtim.tv_sec == b->st_mtim.tv_sec) && (a->st_mtim.tv_nsec == b->st_mtim.tv_nsec);
+}
 
-        close(sd);
+//Open the gzip variant of a cached file, if we have one of its current body
+static int open_gzip_file(cache_disks * cd, const char * hname, const char * pname, struct stat * st){
+    char fpath[PATH_MAX + 8], gzpath[PATH_MAX + 8];
+    struct stat idst;
+
+    const int fd = open_disk_file(cd, hname, pname, GZIP_SUFFIX, st);
+    if(fd == -1){
+        return -1;
     }
-    freeaddrinfo(result);           /* No longer needed */
 
-    return sd;
+    //the body was fetched again since, drop the variant
+    if( (disk_file_path(cd, hname, pname, "", fpath) == NULL) ||
+        (stat(fpath, &idst) == -1) || !same_mtime(st, &idst) ){
+        printf("Dropping stale gzip variant\n");
+        if(disk_file_path(cd, hname, pname, GZIP_SUFFIX, gzpath) != NULL){
+            unlink(gzpath);
+        }
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-static int writen(const int fd, const char * buf, const int len){
-    int i=0;
-    while(i < len){
-        int n = write(fd, &buf[i], len - i);
-        if(n <= 0){
-            perror("write");
-            return -1;
+//Find a header value in a header block, case insensitive
+static const char * find_header(const char * buf, const char * name, size_t * vlen){
+    const size_t name_len = strlen(name);
+    const char * line = strstr(buf, "\r\n");
+
+    while(line && (line[2] != '\r') && (line[2] != '\0')){
+        line += 2;
+
+        if((strncasecmp(line, name, name_len) == 0) && (line[name_len] == ':')){
+            const char * val = &line[name_len + 1];
+            while((*val == ' ') || (*val == '\t')){
+                val++;
+            }
+            const char * end = strstr(val, "\r\n");
+            *vlen = end ? (size_t)(end - val) : strlen(val);
+            return val;
         }
-        i += n;
+        line = strstr(line, "\r\n");
     }
-    return len;
+    return NULL;
 }
 
-static int send_cache_file(const int sd, const int fd){
-    char buf[100];
-    int rv = 0, buf_len;
+//Check if client accepts gzip encoding
+static int accepts_gzip(const char * buf){
+    size_t len;
+    const char * val = find_header(buf, "Accept-Encoding", &len);
+    if(val == NULL){
+        return 0;
+    }
 
-    while((buf_len = read(fd, buf, sizeof(buf))) > 0){
-        if(writen(sd, buf, buf_len) != buf_len){
-            rv = -1;
-            break;
+    char * enc = strndup(val, len);
+    if(enc == NULL){
+        return 0;
+    }
+    char * save_ptr;
+    double gzip_q = -1, any_q = -1;   //-1 if not listed
+
+    //weight of each coding, gzip by name wins over *
+    char * tok = strtok_r(enc, ",", &save_ptr);
+    while(tok){
+        while((*tok == ' ') || (*tok == '\t')){
+            tok++;
+        }
+        const size_t name_len = strcspn(tok, " \t;");
+
+        double q = 1;
+        const char * param = strchr(tok, ';');
+        while(param){
+            param++;
+            while((*param == ' ') || (*param == '\t')){
+                param++;
+            }
+            if(((param[0] == 'q') || (param[0] == 'Q')) && (param[1] == '=')){
+                q = atof(&param[2]);
+            }
+            param = strchr(param, ';');
+        }
+
+        if( ((name_len == 4) && (strncasecmp(tok, "gzip", 4) == 0)) ||
+            ((name_len == 6) && (strncasecmp(tok, "x-gzip", 6) == 0)) ){
+            gzip_q = q;
+        }else if((name_len == 1) && (tok[0] == '*')){
+            any_q = q;
         }
-        rv += buf_len;
+        tok = strtok_r(NULL, ",", &save_ptr);
     }
-    close(fd);
-    return rv;
+    free(enc);
+
+    return (gzip_q >= 0) ? (gzip_q > 0) : (any_q > 0);
 }
 
-static int save_cache_file(const int sd, const char * hname, const char * pname){
-    char buf[100];
-    int err=0, buf_len;
+//Check if origin reply is worth compressing
+static int is_compressible(const char * hdr){
+    static const char * types[] = {"text/", "application/javascript", "application/json",
+                                   "application/xml", "image/svg+xml", NULL};
+    size_t len;
+    int i;
 
-    int fd = creat_cache_file(hname, pname);
-    if(fd == -1){
-        return -1;
+    //only successful, not encoded replies
+    if((strncmp(hdr, "HTTP/1.", 7) != 0) || (strncmp(&hdr[8], " 200", 4) != 0)){
+        return 0;
+    }
+    if(find_header(hdr, "Content-Encoding", &len) != NULL){
+        return 0;
     }
 
-    //send file and cache at the same time
-    while((buf_len = read(sd, buf, sizeof(buf))) > 0){
+    const char * type = find_header(hdr, "Content-Type", &len);
+    if(type == NULL){
+        return 0;
+    }
 
-        if(writen(fd, buf, buf_len) != buf_len){
-            err = -1;
-            break;
+    for(i=0; types[i] != NULL; i++){
+        if(strncasecmp(type, types[i], strlen(types[i])) == 0){
+            return 1;
         }
     }
+    return 0;
+}
 
-    if(err == -1){
-        close(fd);  //close cache file
-        fd = -1;
+//Compress a cached file into its gzip variant
+static int gzip_handler(void * arg){
+    gzip_job_t * job = (gzip_job_t *) arg;
+    static __thread int niced = 0;
+    char tmppath[PATH_MAX + 16], gzpath[PATH_MAX + 8], buf[COPY_BUF_SIZE];
+    int len, err = 0;
+    struct stat st, gzst, idst;
+
+    //compression runs only on spare CPU
+    if(!niced){
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), GZIP_NICE);
+        niced = 1;
     }
 
-    return fd;
-}
+    snprintf(gzpath, sizeof(gzpath), "%s%s", job->fpath, GZIP_SUFFIX);
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", gzpath);
 
-static int cache_file(const int sd, const char *hname, const char * pname, char * hdr, int hdr_len, const int hdr_size){
-    const int serv_sd = connect_to(hname);
-    if(serv_sd == -1){
-        err_reply(sd, 404, "Not Found", "File not found");
+    const int fd = open(job->fpath, O_RDONLY);
+    if(fd == -1){
+        perror("open");
+        __sync_sub_and_fetch(&job->comp->pending, 1);
+        free(job);
         return -1;
     }
 
-    //re-send client request
-    //if(writen(serv_sd, hdr, hdr_len) != hdr_len){
-    //  err_reply(sd, 500, "Some server side error", "Some server side error");
-    //  return -1;
-    //}
-    dprintf(serv_sd, "GET %s HTTP/1.0\r\n", pname);
-    dprintf(serv_sd, "Host: %s\r\n\r\n", hname);
-
-    //receive server reply headers
-    hdr_len = read_headers(serv_sd, hdr, hdr_size);
-    if(hdr_len <= 0){
-        err_reply(sd, 500, "Some server side error", "Some server side error");
+    char mode[8];
+    snprintf(mode, sizeof(mode), "wb%d", GZIP_LEVEL);
+    gzFile gz = gzopen(tmppath, mode);
+    if(gz == NULL){
+        perror("gzopen");
+        close(fd);
+        __sync_sub_and_fetch(&job->comp->pending, 1);
+        free(job);
         return -1;
     }
 
-    //re-send server reply to client
-    if(writen(sd, hdr, hdr_len) != hdr_len){
-        err_reply(sd, 500, "Some server side error", "Some server side error");
-        return -1;
+    while((len = read(fd, buf, sizeof(buf))) > 0){
+        if(gzwrite(gz, buf, len) != len){
+            err = -1;
+            break;
+        }
+    }
+    if((gzclose(gz) != Z_OK) || (len < 0)){
+        err = -1;
     }
 
-    const int fd = save_cache_file(serv_sd, hname, pname);
-    if(fd > 0){
-        //return to beginning of file
-        lseek(fd, 0L, SEEK_SET);
+    //keep the variant only if it saves space, and the body wasn't fetched
+    //again while we compressed it (that also dropped the previous variant).
+    //it gets the body's mtime, so a variant that's renamed in after a
+    //re-fetch all the same is seen as stale when it's served
+    if( (err == 0) &&
+        (fstat(fd, &st) == 0) && (stat(tmppath, &gzst) == 0) &&
+        (gzst.st_size < st.st_size) &&
+        (stat(job->fpath, &idst) == 0) && (idst.st_ino == st.st_ino) && same_mtime(&idst, &st) ){
+
+        const struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if(utimensat(AT_FDCWD, tmppath, times, 0) == -1){
+            perror("utimensat");
+            err = -1;
+        }else if(rename(tmppath, gzpath) == -1){
+            perror("rename");
+            err = -1;
+        }
+    }else{
+        err = -1;
     }
 
-    shutdown(serv_sd, SHUT_RDWR);
-    close(serv_sd);
+    if(err == -1){
+        unlink(tmppath);
+    }
+    close(fd);
 
-    return fd;
+    __sync_sub_and_fetch(&job->comp->pending, 1);
+    free(job);
+    return err;
 }
 
-static int send_hdr_file(const int sd, const int fd){
-    struct stat st;
+//Queue a cached file for background compression
+static void compress_later(struct compressor * comp, cache_disks * cd, const char * hname, const char * pname){
+    char key[PATH_MAX];
 
-    if(fstat(fd, &st) == -1){
-        perror("fstat");
-        err_reply(sd, 500, "Some server side error", "Some server side error");
-        return -1;
+    //over budget, skip this file
+    if(__sync_add_and_fetch(&comp->pending, 1) > GZIP_MAX_PENDING){
+        __sync_sub_and_fetch(&comp->pending, 1);
+        return;
     }
 
-    //send header to client
-    dprintf(sd, "HTTP/1.0 200 OK\r\n");
-    dprintf(sd, "Content-Length: %lu\r\n", st.st_size);
-    dprintf(sd, "Content-Type: text/html\r\nConnection: Closed\r\n\r\n");
+    gzip_job_t * job = (gzip_job_t *) malloc(sizeof(gzip_job_t));
+    if(job == NULL){
+        perror("malloc");
+        __sync_sub_and_fetch(&comp->pending, 1);
+        return;
+    }
+    cache_path(hname, pname, key);
+    if(cache_disk_path(cd, key, job->fpath, sizeof(job->fpath)) == NULL){
+        __sync_sub_and_fetch(&comp->pending, 1);
+        free(job);
+        return;
+    }
+    job->comp = comp;
 
-    return st.st_size;
+    dispatch(comp->tp, gzip_handler, job);
 }
 
-int proxy_handler(void * arg){
-
-    dispatch_t * data = (dispatch_t *) arg;
-    const int sd = data->sd;
-    const struct filter * filt = data->filt;
-    free(data);
-
-    char hname[NI_MAXHOST], pname[PATH_MAX];
+//Monotonic time in milliseconds
+static long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
 
-    const size_t buf_size = 4*1024;
-    char * buf = malloc(sizeof(char)*buf_size);
-    if(buf == NULL){
-        perror("malloc");
+//Connect to host, racing its addresses (RFC 8305 happy eyeballs).
+//IPv6 and IPv4 addresses are interleaved, a new attempt starts every
+//CONNECT_ATTEMPT_DELAY (or right after one fails), first to connect wins.
+static int connect_to(const char * hname, const char * port, struct timeouts * to){
+    struct addrinfo hints, *result, *rp;
+    struct addrinfo * addrs[MAX_CONNECT_ADDRS];
+    struct pollfd fds[MAX_CONNECT_ADDRS];
+    int s, i, sd = -1, err = ECONNREFUSED;
+    int naddrs = 0, nfds = 0, next = 0;
 
-        err_reply(sd, 500, "Some server side error", "Some server side error");
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;      /* Allow IPv4 and IPv6 */
+    hints.ai_socktype = SOCK_STREAM;  /* TCP */
 
-        shutdown(sd, SHUT_RDWR);
-        close(sd);
+    s = getaddrinfo(hname, port, &hints, &result);
+    if (s != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
         return -1;
     }
 
-    //process client connection
-    while(1){
-
-        //read the request
-        size_t buf_len = read_headers(sd, buf, buf_size);
-        if(buf_len < 0){
-            err_reply(sd, 400, "Bad Request", "Bad Request");
-            break;
+    //interleave families, starting with the preferred one
+    struct addrinfo * first = result, * second = result;
+    while(naddrs < MAX_CONNECT_ADDRS){
+        while(first && (first->ai_family != result->ai_family)){
+            first = first->ai_next;
         }
-
-        //check if we have a GET request with path and HTTP protocol
-        if((is_legal(sd, buf, buf_len, hname, pname) < 0) ){
+        while(second && (second->ai_family == result->ai_family)){
+            second = second->ai_next;
+        }
+        if((first == NULL) && (second == NULL)){
             break;
         }
 
-        if(is_resolveable(hname) < 0){
-            err_reply(sd, 404, "Not Found", "File not found");
-            break;
+        if(first){
+            addrs[naddrs++] = first;
+            first = first->ai_next;
         }
+        if(second && (naddrs < MAX_CONNECT_ADDRS)){
+            addrs[naddrs++] = second;
+            second = second->ai_next;
+        }
+    }
+
+    const long deadline = now_ms() + CONNECT_TIMEOUT;
+    long next_attempt = now_ms();
+
+    while(sd == -1){
+        const long now = now_ms();
 
-        if(is_filtered(hname, filt) < 0){
-            err_reply(sd, 403, "Forbidden", "Access denied");
+        if(now >= deadline){
+            __sync_add_and_fetch(&to->expired[TO_CONNECT], 1);
+            err = ETIMEDOUT;
             break;
         }
 
-        //request is valid, print it
-        printf("HTTP request =\n%s\nLEN = %lu\n", buf, buf_len);
+        //start next attempt when its time, or if nothing is in flight
+        if((next < naddrs) && ((now >= next_attempt) || (nfds == 0))){
+            rp = addrs[next++];
+            next_attempt = now + CONNECT_ATTEMPT_DELAY;
 
-        size_t response_bytes = 0;
+            const int fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol);
+            if(fd == -1){
+                err = errno;
+                continue;
+            }
 
-        int fd = open_cache_file(hname, pname);
-        if(fd != -1){
-            response_bytes = send_hdr_file(sd, fd);
-            printf("File is given from local filesystem\n");
-        }else{
-            fd = cache_file(sd, hname, pname, buf, buf_len, buf_size);
-            if(fd > 0){
-                printf("File is given from origin filesystem\n");
+            if(connect(fd, rp->ai_addr, rp->ai_addrlen) == 0){
+                sd = fd;    //connected right away
+            }else if(errno == EINPROGRESS){
+                fds[nfds].fd = fd;
+                fds[nfds].events = POLLOUT;
+                fds[nfds].revents = 0;
+                nfds++;
+            }else{
+                err = errno;
+                close(fd);
             }
+            continue;
         }
 
-        if(fd > 0){
-            response_bytes = send_cache_file(sd, fd);
-            printf("Total response bytes: %lu\n", response_bytes);
+        //all addresses failed
+        if(nfds == 0){
+            break;
         }
 
-        //serve only one request per connection
-        break;
-    }
-    free(buf);
+        //wait for a connection, up to the next attempt or deadline
+        long wait = deadline - now;
+        if((next < naddrs) && (next_attempt - now < wait)){
+            wait = next_attempt - now;
+        }
 
-    //close the connection after reply is sent
-    shutdown(sd, SHUT_RDWR);
-    close(sd);
+        const int n = poll(fds, nfds, wait);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            err = errno;
+            break;
+        }
 
-    return 0;
-}
+        for(i = nfds - 1; (i >= 0) && (sd == -1); i--){
+            int so_err = 0;
+            socklen_t len = sizeof(so_err);
 
-static int check_arguments(struct arguments * arg, const int argc, char * argv[]){
+            if(fds[i].revents == 0){
+                continue;
+            }
 
-    if(argc != 5){
-        fprintf(stderr, "Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
-        return -1;
-    }
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &so_err, &len);
+            if(so_err == 0){
+                sd = fds[i].fd;     /* Success */
+            }else{
+                err = so_err;
+                close(fds[i].fd);
 
-    arg->port         = atoi(argv[1]);
-    arg->pool_size    = atoi(argv[2]);
-    arg->max_requests = atoi(argv[3]);
-    arg->filter       =      argv[4];
+                //failed attempt, start the next one now
+                next_attempt = now;
+            }
+            fds[i] = fds[--nfds];
+        }
+    }
 
-    //check if number arguments are valid
-    if( (arg->port < 0)      || (arg->port > 65535) ||
-        (arg->pool_size < 0) || (arg->pool_size > MAXT_IN_POOL) ||
-        (arg->max_requests < 0)){
-        fprintf(stderr, "Error: Invalid arguments\n");
+    //cancel the losing attempts
+    for(i=0; i < nfds; i++){
+        close(fds[i].fd);
     }
+    freeaddrinfo(result);           /* No longer needed */
 
-    //check file exists and is readable
-    if(access(arg->filter, R_OK) == -1){
-        perror(arg->filter);
+    if(sd == -1){
+        errno = err;
         return -1;
     }
 
-    return 0;
+    //rest of the proxy uses blocking sockets
+    const int flags = fcntl(sd, F_GETFL);
+    fcntl(sd, F_SETFL, flags & ~O_NONBLOCK);
+
+    return sd;
+}
+
+static int writen(const int fd, const char * buf, const int len){
+    int i=0;
+    while(i < len){
+        int n = write(fd, &buf[i], len - i);
+        if(n <= 0){
+            perror("write");
+            return -1;
+        }
+        i += n;
+    }
+    return len;
+}
+
+//Find when an origin reply goes stale, 0 if it doesn't say
+static time_t parse_expires(const char * hdr){
+    const time_t now = time(NULL);
+    size_t len;
+    struct tm tm;
+
+    const char * cc = find_header(hdr, "Cache-Control", &len);
+    if(cc){
+        char * val = strndup(cc, len);
+        const char * age = strstr(val, "s-maxage=");
+        if(age == NULL){
+            age = strstr(val, "max-age=");
+        }
+
+        time_t expires = 0;
+        if(strstr(val, "no-store") || strstr(val, "no-cache")){
+            expires = now;
+        }else if(age){
+            expires = now + atol(strchr(age, '=') + 1);
+        }
+        free(val);
+
+        if(expires){
+            return expires;
+        }
+    }
+
+    const char * exp = find_header(hdr, "Expires", &len);
+    if(exp){
+        memset(&tm, 0, sizeof(tm));
+        if(strptime(exp, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL){
+            return timegm(&tm);
+        }
+        return now;     //invalid date means already expired
+    }
+
+    return 0;
+}
+
+//Set body framing, from reply status and headers
+//Skip spaces and tabs, up to end
+static const char * skip_ows(const char * p, const char * end){
+    while((p < end) && ((*p == ' ') || (*p == '\t'))){
+        p++;
+    }
+    return p;
+}
+
+//Body length from the Content-Length headers of a reply.
+//returns 1 with the length, 0 if there is none, or -1 if a value is not
+//a number, or the headers (or a merged list) give different lengths
+static int content_length(const char * hdr, off_t * length){
+    const char * line = strstr(hdr, "\r\n");
+    int found = 0;
+
+    while(line && (line[2] != '\r') && (line[2] != '\0')){
+        line += 2;
+        const char * end = strstr(line, "\r\n");
+        if(end == NULL){
+            break;
+        }
+
+        if(strncasecmp(line, "Content-Length:", 15) == 0){
+            const char * p = &line[15];
+            do{
+                off_t val = 0;
+
+                p = skip_ows(p, end);
+                if((p == end) || !isdigit((unsigned char) *p)){
+                    return -1;  //empty, negative or not a number
+                }
+                while((p < end) && isdigit((unsigned char) *p)){
+                    if(val > (LLONG_MAX - 9) / 10){
+                        return -1;
+                    }
+                    val = val * 10 + (*p++ - '0');
+                }
+                p = skip_ows(p, end);
+                if((p < end) && (*p++ != ',')){
+                    return -1;
+                }
+
+                if(found && (val != *length)){
+                    return -1;
+                }
+                *length = val;
+                found = 1;
+            }while(p < end);
+        }
+        line = end;
+    }
+
+    return found;
+}
+
+//Find how a reply body is framed, -1 if its length is invalid
+static int body_init(body_t * body, const int sd, const char * hdr, const int code){
+    size_t len;
+
+    body->sd = sd;
+    body->left = 0;
+    body->in_chunk = body->end = 0;
+    body->pos = body->len = 0;
+
+    //these replies never have a body
+    if((code < 200) || (code == 204) || (code == 304)){
+        body->framing = BODY_NONE;
+        return 0;
+    }
+
+    const char * te = find_header(hdr, "Transfer-Encoding", &len);
+
+    //chunked overrides length
+    if(te && (strncasecmp(te, "identity", 8) != 0)){
+        body->framing = BODY_CHUNKED;
+        return 0;
+    }
+
+    switch(content_length(hdr, &body->left)){
+    case 1:
+        body->framing = BODY_LENGTH;
+        return 0;
+    case 0:
+        body->framing = BODY_CLOSE;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+//Read next raw byte of body
+static int body_getc(body_t * body){
+
+    if(body->pos == body->len){
+        const ssize_t n = read(body->sd, body->buf, sizeof(body->buf));
+        if(n <= 0){
+            return -1;
+        }
+        body->pos = 0;
+        body->len = n;
+    }
+    return (unsigned char) body->buf[body->pos++];
+}
+
+//Read a CRLF terminated line of chunked framing
+static int body_line(body_t * body, char * line, const size_t size){
+    size_t i = 0;
+    int c;
+
+    while((c = body_getc(body)) != '\n'){
+        if((c == -1) || (i >= size - 1)){
+            return -1;
+        }
+        line[i++] = c;
+    }
+
+    if((i > 0) && (line[i-1] == '\r')){
+        i--;
+    }
+    line[i] = '\0';
+
+    return i;
+}
+
+//Read decoded body bytes, returns 0 at body end
+static ssize_t body_read(body_t * body, char * out, const size_t size){
+    char line[128];
+    ssize_t n;
+
+    if(body->framing == BODY_NONE){
+        return 0;
+    }
+
+    if((body->framing == BODY_CHUNKED) && (body->left == 0)){
+        if(body->end){
+            return 0;
+        }
+
+        //previous chunk data ends with CRLF
+        if(body->in_chunk && (body_line(body, line, sizeof(line)) != 0)){
+            return -1;
+        }
+        body->in_chunk = 0;
+
+        //chunk size, in hex, maybe with extensions
+        char * end;
+        if(body_line(body, line, sizeof(line)) <= 0){
+            return -1;
+        }
+        body->left = strtoll(line, &end, 16);
+        if((end == line) || (body->left < 0)){
+            return -1;
+        }
+
+        if(body->left == 0){
+            //last chunk, skip trailers up to empty line
+            do{
+                if(body_line(body, line, sizeof(line)) < 0){
+                    return -1;
+                }
+            }while(line[0] != '\0');
+
+            body->end = 1;
+            return 0;
+        }
+        body->in_chunk = 1;
+    }
+
+    if((body->framing == BODY_LENGTH) && (body->left == 0)){
+        return 0;
+    }
+
+    size_t want = size;
+    if((body->framing != BODY_CLOSE) && (want > (size_t) body->left)){
+        want = body->left;
+    }
+
+    //use buffered bytes first, then read directly
+    if(body->pos < body->len){
+        n = body->len - body->pos;
+        if((size_t) n > want){
+            n = want;
+        }
+        memcpy(out, &body->buf[body->pos], n);
+        body->pos += n;
+    }else{
+        n = read(body->sd, out, want);
+        if(n == 0){
+            //only a close delimited body can end here
+            return (body->framing == BODY_CLOSE) ? 0 : -1;
+        }
+        if(n < 0){
+            perror("read");
+            return -1;
+        }
+    }
+
+    if(body->framing != BODY_CLOSE){
+        body->left -= n;
+    }
+    return n;
+}
+
+//Fetch failed before reply started, client gets an error
+static void fetch_error(response_t * rsp, const int code, const char * reason, const char * msg){
+    pthread_mutex_lock(&rsp->lock);
+    set_error(rsp, code, reason, msg);
+    rsp->hdr_ready = rsp->done = 1;
+    pthread_cond_signal(&rsp->ready);
+    pthread_mutex_unlock(&rsp->lock);
+}
+
+//Send a request upstream and read its reply header.
+//returns 0, or -1 with errno ETIMEDOUT if upstream took too long,
+//or EPROTO if its reply header is malformed or longer than hdr_size
+static int request_upstream(const int sd, const char * req, const int req_len, char * hdr, const int hdr_size,
+                            io_timer_t * timer, int * code, char reason[64]){
+
+    if(writen(sd, req, req_len) != req_len){
+        errno = EPIPE;
+        return -1;
+    }
+
+    io_arm(timer, TO_FIRST_BYTE);
+    const int hdr_len = read_headers(sd, hdr, hdr_size);
+    if(io_disarm(timer) == 0){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    //a header that didn't fit, or was cut short, can't be framed
+    if((hdr_len < 4) || (strcmp(&hdr[hdr_len - 4], "\r\n\r\n") != 0)){
+        errno = EPROTO;
+        return -1;
+    }
+
+    //the status code, then the reason up to the line end, it may be empty
+    int end = 0;
+    if( (sscanf(hdr, "HTTP/%*d.%*d %3d%n", code, &end) != 1) || (end == 0) ||
+        ((hdr[end] != ' ') && (hdr[end] != '\r')) ){
+        errno = EPROTO;
+        return -1;
+    }
+    const char * r = (hdr[end] == ' ') ? &hdr[end + 1] : &hdr[end];
+    snprintf(reason, 64, "%.*s", (int) strcspn(r, "\r\n"), r);
+    return 0;
+}
+
+//Find the peer an address belongs to, -1 if it's not a peer's
+static int peer_at(const struct peers * peers, const struct sockaddr_storage * inaddr){
+    int i, j, family;
+
+    const unsigned char * addr = ip_of((const struct sockaddr *) inaddr, &family);
+    if(addr == NULL){
+        return -1;
+    }
+
+    for(i=0; i < peers->num; i++){
+        for(j=0; (i != peers->self) && (j < peers->list[i].num_addrs); j++){
+            if(net_match(&peers->list[i].addrs[j], family, addr)){
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+//Find the peer owning a cache key, NULL if it's ours or we don't ask peers
+static struct peer * peer_of(struct peers * peers, const char * key){
+    const long now = time(NULL);
+    int i;
+
+    //failed peers get another chance after a while
+    for(i=0; i < peers->num; i++){
+        if(!hashring_is_up(peers->ring, i) && (now >= peers->list[i].down_until)){
+            hashring_set_up(peers->ring, i, 1);
+        }
+    }
+
+    const int node = hashring_lookup(peers->ring, key);
+    if((node == -1) || (node == peers->self)){
+        return NULL;
+    }
+    return &peers->list[node];
+}
+
+//Ask the peer owning the request for it, so a miss is fetched once for all peers.
+//returns the peer socket with the reply header read, or -1 to go to origin
+static int ask_peer(response_t * rsp, char * hdr, const int hdr_size, io_timer_t * timer,
+                    int * code, char reason[64]){
+    char key[PATH_MAX];
+
+    //a request from a peer is never forwarded again, so it can't loop
+    if((rsp->peers == NULL) || rsp->from_peer){
+        return -1;
+    }
+
+    cache_path(rsp->hname, rsp->pname, key);
+    struct peer * peer = peer_of(rsp->peers, key);
+    if(peer == NULL){
+        return -1;
+    }
+    __sync_add_and_fetch(&rsp->peers->asked, 1);
+
+    int reply = 0;  //status the peer replied with, 0 if it didn't
+    const int sd = connect_to(peer->host, peer->port, rsp->to);
+    if(sd != -1){
+        io_timer_init(timer, sd, rsp->to);
+
+        //plain proxy request, the peer serves it from its cache or its origin
+        char req[NI_MAXHOST * 2 + PATH_MAX + 160];
+        const int req_len = snprintf(req, sizeof(req),
+                                     "GET http://%s%s HTTP/1.1\r\nHost: %s\r\n"
+                                     PEER_HEADER ": %s\r\n"
+                                     "Accept-Encoding: identity\r\nConnection: close\r\n\r\n",
+                                     rsp->hname, rsp->pname, rsp->hname,
+                                     rsp->peers->list[rsp->peers->self].name);
+
+        if(request_upstream(sd, req, req_len, hdr, hdr_size, timer, code, reason) == 0){
+            //only the object itself is taken, never an error page
+            if((*code >= 200) && (*code < 300)){
+                printf("Asked peer %s for %s\n", peer->name, key);
+                return sd;
+            }
+            reply = *code;
+        }
+        close(sd);
+    }
+    __sync_add_and_fetch(&rsp->peers->failed, 1);
+
+    //the peer works, but didn't give us the object, origin will
+    if((reply != 0) && (reply < 500) && (reply != 429)){
+        fprintf(stderr, "Peer %s replied %d, going to origin\n", peer->name, reply);
+        return -1;
+    }
+
+    //down, overloaded or broken, skip the peer for a while,
+    //its keys go to the next one on the ring
+    fprintf(stderr, "Peer %s failed, going to origin\n", peer->name);
+    peer->down_until = time(NULL) + PEER_RETRY_SECS;
+    hashring_set_up(rsp->peers->ring, peer - rsp->peers->list, 0);
+
+    return -1;
+}
+
+//Send the request to origin.
+//returns the origin socket with the reply header read, or -1 with the error reply set
+static int ask_origin(response_t * rsp, char * hdr, const int hdr_size, io_timer_t * timer,
+                      int * code, char reason[64]){
+
+    errno = 0;
+    const int serv_sd = connect_to(rsp->hname, rsp->port, rsp->to);
+    if(serv_sd == -1){
+        if(errno == ETIMEDOUT){
+            fetch_error(rsp, 504, "Gateway Timeout", "Origin server did not respond in time");
+        }else{
+            fetch_error(rsp, 404, "Not Found", "File not found");
+        }
+        return -1;
+    }
+    io_timer_init(timer, serv_sd, rsp->to);
+
+    //re-send client request, we take any framing the origin uses
+    char req[NI_MAXHOST + PATH_MAX + 128];
+    const int req_len = snprintf(req, sizeof(req),
+                                 "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                                 "Accept-Encoding: identity\r\nConnection: close\r\n\r\n",
+                                 rsp->pname, rsp->hname);
+
+    if(request_upstream(serv_sd, req, req_len, hdr, hdr_size, timer, code, reason) == -1){
+        if(errno == ETIMEDOUT){
+            fetch_error(rsp, 504, "Gateway Timeout", "Origin server did not respond in time");
+        }else if(errno == EPROTO){
+            fetch_error(rsp, 502, "Bad Gateway", "Invalid reply from server");
+        }else{
+            fetch_error(rsp, 500, "Some server side error", "Some server side error");
+        }
+        close(serv_sd);
+        return -1;
+    }
+
+    return serv_sd;
+}
+
+//Write a buffer of body to its cache file, and let the writer send it
+//(runs on the I/O workers of its disk)
+static int write_cache_file(void * arg){
+    cache_file_t * file = (cache_file_t *) arg;
+    response_t * rsp = file->rsp;
+
+    if(writen(file->fd, file->buf, file->len) != file->len){
+        cache_disk_error(file->disk, errno);
+        return -1;
+    }
+
+    pthread_mutex_lock(&rsp->lock);
+    rsp->avail += file->len;
+    pthread_cond_signal(&rsp->ready);
+    pthread_mutex_unlock(&rsp->lock);
+
+    return 0;
+}
+
+//Move a complete body to its cache path, or drop it
+//(runs on the I/O workers of its disk)
+static int close_cache_file(void * arg){
+    cache_file_t * file = (cache_file_t *) arg;
+
+    if((file->err == 0) && (rename(file->tmppath, file->fpath) == -1)){
+        perror("rename");
+        cache_disk_error(file->disk, errno);
+        file->err = -1;
+    }
+    if(file->err == 0){
+        struct stat st;
+        cache_disk_ok(file->disk);
+        if(fstat(file->fd, &st) == 0){
+            cache_index_put(file->rsp->idx, file->key, st.st_size, st.st_mtime, file->rsp->expires);
+        }
+    }else{
+        unlink(file->tmppath);
+    }
+
+    return file->err;
+}
+
+//Save decoded body to cache, while the writer sends it to client.
+//the file I/O is done by the workers of its disk, so a slow disk holds up
+//only its own fetches, and the next buffer is read while one is written
+static int save_cache_file(response_t * rsp, body_t * body, io_timer_t * timer){
+    char bufs[2][COPY_BUF_SIZE];
+    cache_file_t file;
+    cache_disk_op op;
+    ssize_t buf_len;
+    int cur = 0, writing = 0;
+
+    file.rsp = rsp;
+    file.fd = -1;
+    file.err = 0;
+    cache_path(rsp->hname, rsp->pname, file.key);
+    file.disk = cache_disk_path(rsp->disks, file.key, file.fpath, sizeof(file.fpath));
+    if(file.disk == NULL){
+        fprintf(stderr, "Error: No cache disk for %s\n", file.key);
+        return -1;
+    }
+    //unique per fetching thread, so concurrent fetches don't mix
+    snprintf(file.tmppath, sizeof(file.tmppath), "%s.~tmp%ld", file.fpath, (long) syscall(SYS_gettid));
+
+    if(cache_disk_run(file.disk, creat_cache_file, &file) == -1){
+        return -1;
+    }
+
+    //reply can start now
+    pthread_mutex_lock(&rsp->lock);
+    rsp->fd = file.fd;
+    rsp->hdr_ready = 1;
+    pthread_cond_signal(&rsp->ready);
+    pthread_mutex_unlock(&rsp->lock);
+
+    io_arm(timer, TO_BODY_IDLE);
+    while((buf_len = body_read(body, bufs[cur], COPY_BUF_SIZE)) > 0){
+
+        //made progress, push the deadline
+        io_arm(timer, TO_BODY_IDLE);
+
+        //the other buffer must be written before this one is
+        if(writing && (cache_disk_wait(&op) == -1)){
+            writing = 0;
+            file.err = -1;
+            break;
+        }
+
+        file.buf = bufs[cur];
+        file.len = buf_len;
+        cache_disk_submit(file.disk, &op, write_cache_file, &file);
+        writing = 1;
+        cur = !cur;
+    }
+    io_disarm(timer);
+    if(writing && (cache_disk_wait(&op) == -1)){
+        file.err = -1;
+    }
+    if(buf_len < 0){
+        file.err = -1;
+    }
+
+    //file is complete, move it to cache path
+    cache_disk_run(file.disk, close_cache_file, &file);
+
+    //fd is closed by writer
+    pthread_mutex_lock(&rsp->lock);
+    if(file.err == 0){
+        rsp->length = rsp->avail;
+    }
+    rsp->failed = (file.err == -1);
+    rsp->done = 1;
+    pthread_cond_signal(&rsp->ready);
+    pthread_mutex_unlock(&rsp->lock);
+
+    return file.err;
+}
+
+//Headers that are about one connection, and those we set in our reply
+static const char * const hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization",
+    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length", "Content-Type", PEER_HEADER
+};
+
+//Check if a header name is in a comma separated list, case insensitive
+static int in_list(const char * list, size_t list_len, const char * name, const size_t name_len){
+    while(list_len > 0){
+        size_t tok = 0;
+        while((list_len > 0) && ((*list == ' ') || (*list == '\t') || (*list == ','))){
+            list++;
+            list_len--;
+        }
+        while((tok < list_len) && (list[tok] != ',') && (list[tok] != ' ') && (list[tok] != '\t')){
+            tok++;
+        }
+        if((tok == name_len) && (strncasecmp(list, name, name_len) == 0)){
+            return 1;
+        }
+        list += tok;
+        list_len -= tok;
+    }
+    return 0;
+}
+
+//Copy the end-to-end headers of an upstream reply, to forward them.
+//hop-by-hop headers, the ones its Connection header names, and the
+//ones we set ourselves are left out. returns NULL if it can't
+static char * e2e_headers(const char * hdr){
+    size_t conn_len = 0, i;
+    const char * conn = find_header(hdr, "Connection", &conn_len);
+    int keep = 0;
+
+    char * out = (char *) malloc(strlen(hdr) + 1);
+    if(out == NULL){
+        perror("malloc");
+        return NULL;
+    }
+    char * o = out;
+
+    //skip the status line
+    const char * line = strstr(hdr, "\r\n");
+    while(line && (line[2] != '\r') && (line[2] != '\0')){
+        line += 2;
+        const char * end = strstr(line, "\r\n");
+        if(end == NULL){
+            break;
+        }
+
+        //a folded line goes with the header before it
+        if((*line != ' ') && (*line != '\t')){
+            const char * colon = memchr(line, ':', end - line);
+            keep = (colon != NULL) && (colon > line);
+            if(keep){
+                const size_t name_len = colon - line;
+                for(i=0; keep && (i < sizeof(hop_headers) / sizeof(hop_headers[0])); i++){
+                    keep = !((strlen(hop_headers[i]) == name_len) && (strncasecmp(line, hop_headers[i], name_len) == 0));
+                }
+                keep = keep && !(conn && in_list(conn, conn_len, line, name_len));
+            }
+        }
+
+        if(keep){
+            memcpy(o, line, end + 2 - line);
+            o += end + 2 - line;
+        }
+        line = end;
+    }
+    *o = '\0';
+
+    return out;
+}
+
+//Fetch a reply into the cache, from a peer or origin
+static int cache_file(response_t * rsp){
+    char hdr[REPLY_HDR_SIZE];
+    const int hdr_size = sizeof(hdr);
+    size_t len;
+    int code;
+    char reason[64];
+    io_timer_t timer;
+
+    int serv_sd = ask_peer(rsp, hdr, hdr_size, &timer, &code, reason);
+    rsp->via_peer = (serv_sd != -1);
+    if(serv_sd == -1){
+        serv_sd = ask_origin(rsp, hdr, hdr_size, &timer, &code, reason);
+        if(serv_sd == -1){
+            return -1;
+        }
+    }
+
+    //writer reads these only after hdr_ready
+    rsp->code = code;
+    strcpy(rsp->reason, reason);
+
+    //keep the origin content type for our reply
+    const char * ctype = find_header(hdr, "Content-Type", &len);
+    if(ctype){
+        snprintf(rsp->ctype, sizeof(rsp->ctype), "%.*s", (int) len, ctype);
+    }
+    //and its other headers (Location, Set-Cookie, Cache-Control, ETag...)
+    rsp->hdrs = e2e_headers(hdr);
+
+    const int compress = is_compressible(hdr);
+    rsp->expires = parse_expires(hdr);
+
+    body_t * body = (body_t *) malloc(sizeof(body_t));
+    if(body == NULL){
+        perror("malloc");
+        fetch_error(rsp, 500, "Some server side error", "Some server side error");
+        close(serv_sd);
+        return -1;
+    }
+    if(body_init(body, serv_sd, hdr, code) == -1){
+        fetch_error(rsp, 502, "Bad Gateway", "Invalid reply from server");
+        free(body);
+        close(serv_sd);
+        return -1;
+    }
+
+    if(body->framing == BODY_LENGTH){
+        rsp->length = body->left;
+    }else if(body->framing == BODY_NONE){
+        rsp->length = 0;
+    }
+
+    const int rv = save_cache_file(rsp, body, &timer);
+    if(rv == -1){
+        pthread_mutex_lock(&rsp->lock);
+        const int started = rsp->hdr_ready;
+        pthread_mutex_unlock(&rsp->lock);
+
+        if(!started){
+            fetch_error(rsp, 500, "Some server side error", "Some server side error");
+        }
+    }else if(compress && (rsp->length >= GZIP_MIN_SIZE)){
+        compress_later(rsp->comp, rsp->disks, rsp->hname, rsp->pname);
+    }
+    free(body);
+
+    shutdown(serv_sd, SHUT_RDWR);
+    close(serv_sd);
+
+    if(rv == 0){
+        printf("File is given from %s filesystem\n", rsp->via_peer ? "peer" : "origin");
+    }
+    return rv;
+}
+
+//Fetch a reply from origin, while other replies are sent (runs on the fetcher threadpool)
+static int fetch_handler(void * arg){
+    response_t * rsp = (response_t *) arg;
+    struct fetchers * fetch = rsp->fetch;
+
+    const int rv = cache_file(rsp);
+
+    //the slot is released once we let go of it
+    pthread_mutex_lock(&rsp->lock);
+    rsp->fetching = 0;
+    pthread_cond_signal(&rsp->ready);
+    pthread_mutex_unlock(&rsp->lock);
+
+    __sync_sub_and_fetch(&fetch->busy, 1);
+    return rv;
+}
+
+static int send_hdr_file(const int sd, const response_t * rsp, const int chunked){
+    char len_hdr[64];
+
+    if(chunked){
+        snprintf(len_hdr, sizeof(len_hdr), "Transfer-Encoding: chunked\r\n");
+    }else{
+        snprintf(len_hdr, sizeof(len_hdr), "Content-Length: %lu\r\n", rsp->length);
+    }
+
+    //send header to client, body will follow with sendfile,
+    //the upstream headers fit, they came in a buffer of the same size
+    char hdr[REPLY_HDR_SIZE + 512];
+    const int hdr_len = snprintf(hdr, sizeof(hdr),
+                                 "HTTP/1.%d %d %s\r\n"
+                                 "%s"
+                                 "%s"
+                                 "%s"
+                                 "Vary: Accept-Encoding\r\n"
+                                 "Content-Type: %s\r\nConnection: %s\r\n\r\n",
+                                 rsp->http11, rsp->code, rsp->reason,
+                                 rsp->hdrs ? rsp->hdrs : "", len_hdr,
+                                 rsp->gzip ? "Content-Encoding: gzip\r\n" : "",
+                                 rsp->ctype, rsp->keep_alive ? "keep-alive" : "Closed");
+    if((hdr_len >= (int) sizeof(hdr)) || (send(sd, hdr, hdr_len, MSG_MORE | MSG_NOSIGNAL) != hdr_len)){
+        perror("send");
+        return -1;
+    }
+
+    return hdr_len;
+}
+
+//Send body from fd as it grows, re-chunked if length is unknown
+static off_t send_body(const int sd, response_t * rsp, const int chunked, io_timer_t * timer){
+    off_t sent = 0, avail;
+    int failed;
+    char chunk[32];
+
+    while(1){
+        //wait for more body, or its end
+        pthread_mutex_lock(&rsp->lock);
+        while((rsp->avail == sent) && !rsp->done){
+            pthread_cond_wait(&rsp->ready, &rsp->lock);
+        }
+        avail  = rsp->avail;
+        failed = rsp->failed;
+        pthread_mutex_unlock(&rsp->lock);
+
+        if(avail == sent){
+            break;  //done
+        }
+
+        if(chunked){
+            const int len = snprintf(chunk, sizeof(chunk), "%lx\r\n", avail - sent);
+            if(send(sd, chunk, len, MSG_MORE | MSG_NOSIGNAL) != len){
+                return -1;
+            }
+        }
+
+        //let the kernel copy the file to socket, a buffer at a time, so the
+        //idle deadline is pushed on each bit of progress, and the client has
+        //to keep reading rather than finish the whole body in time
+        while(sent < avail){
+            const off_t from = sent;
+            const off_t want = (avail - sent > COPY_BUF_SIZE) ? COPY_BUF_SIZE : avail - sent;
+
+            //pace the client to its byte rate, no buffer goes out while its
+            //buckets are in debt, they are checked again after each nap,
+            //since the client's other connections take from them too
+            if(rsp->limits){
+                long wait = ratelimit_bytes(rsp->limits, rsp->client, 0);
+                if(wait > 0){
+                    io_disarm(timer);
+                }
+                while(wait > 0){
+                    usleep(((wait > PACE_MAX_SLEEP_MS) ? PACE_MAX_SLEEP_MS : wait) * 1000);
+                    wait = ratelimit_bytes(rsp->limits, rsp->client, 0);
+                }
+            }
+
+            io_arm(timer, TO_BODY_IDLE);
+            if(sendfile(sd, rsp->fd, &sent, want) <= 0){
+                perror("sendfile");
+                io_disarm(timer);
+                return -1;
+            }
+            if(rsp->limits){
+                ratelimit_bytes(rsp->limits, rsp->client, sent - from);
+            }
+        }
+        io_disarm(timer);
+
+        if(chunked && (send(sd, "\r\n", 2, MSG_NOSIGNAL) != 2)){
+            return -1;
+        }
+    }
+
+    //don't end a body we didn't get all of
+    if(failed){
+        return -1;
+    }
+
+    if(chunked && (send(sd, "0\r\n\r\n", 5, MSG_NOSIGNAL) != 5)){
+        return -1;
+    }
+
+    return sent;
+}
+
+//Find end of the first request in buffer, 0 if its not complete
+static size_t request_end(const char * buf, const size_t buf_len){
+    size_t i;
+    for(i=4; i <= buf_len; i++){
+        if(strncmp(&buf[i - 4], "\r\n\r\n", 4) == 0){
+            return i;
+        }
+    }
+    return 0;
+}
+
+//Check a request and start its reply, from cache or origin
+static void start_response(response_t * rsp, char * req, const size_t req_len, const dispatch_t * conn){
+    size_t len;
+    struct stat st;
+    char key[PATH_MAX];
+
+    memset(rsp, 0, sizeof(response_t));
+    rsp->fd = -1;
+    strcpy(rsp->port, "80");
+    rsp->comp = conn->comp;
+    rsp->fetch = conn->fetch;
+    rsp->to = conn->to;
+    rsp->idx = conn->idx;
+    rsp->disks = conn->disks;
+    rsp->peers = conn->peers;
+    rsp->limits = conn->limits;
+    rsp->client = &conn->inaddr;
+    rsp->code = 200;
+    rsp->length = -1;
+    strcpy(rsp->reason, "OK");
+    strcpy(rsp->ctype, "text/html");
+    pthread_mutex_init(&rsp->lock, NULL);
+    pthread_cond_init(&rsp->ready, NULL);
+
+    //errors below are ready to send
+    rsp->hdr_ready = rsp->done = 1;
+
+    //is_legal modifies the headers, check them first
+    rsp->accept_gzip = accepts_gzip(req);
+    const char * conn_hdr = find_header(req, "Connection", &len);
+    const int conn_close = conn_hdr && (strncasecmp(conn_hdr, "close", 5) == 0);
+    const int conn_keep  = conn_hdr && (strncasecmp(conn_hdr, "keep-alive", 10) == 0);
+    rsp->from_peer = (find_header(req, PEER_HEADER, &len) != NULL);
+
+    //check if we have a GET request with path and HTTP protocol
+    if(is_legal(rsp, req, req_len, rsp->hname, rsp->pname) < 0){
+        return;
+    }
+    rsp->keep_alive = rsp->http11 ? !conn_close : conn_keep;
+
+    //a peer fetches for all its clients, so it's not limited as one of them,
+    //only a request marked by a peer, and sent from its address, is taken as the peer's
+    if(rsp->from_peer && rsp->peers && (peer_at(rsp->peers, rsp->client) != -1)){
+        rsp->limits = NULL;
+    }
+
+    //client, or its network, sends more than its share
+    if(rsp->limits && !ratelimit_request(rsp->limits, rsp->client)){
+        set_error(rsp, 429, "Too Many Requests", "Too many requests");
+        return;
+    }
+
+    if(is_resolveable(rsp->hname) < 0){
+        set_error(rsp, 404, "Not Found", "File not found");
+        return;
+    }
+
+    if(is_filtered(rsp->hname, conn->filt) != 0){
+        set_error(rsp, 403, "Forbidden", "Access denied");
+        return;
+    }
+
+    //tunnel is opened when its turn to reply comes
+    if(rsp->tunnel){
+        rsp->keep_alive = 0;
+        printf("CONNECT request = %s:%s\n", rsp->hname, rsp->port);
+        return;
+    }
+
+    //request is valid, print it
+    printf("HTTP request =\n%s\nLEN = %lu\n", req, req_len);
+
+    if(rsp->accept_gzip){
+        rsp->fd = open_gzip_file(rsp->disks, rsp->hname, rsp->pname, &st);
+        rsp->gzip = (rsp->fd != -1);
+    }
+    if(rsp->fd == -1){
+        rsp->fd = open_cache_file(rsp->disks, rsp->hname, rsp->pname, &st);
+    }
+
+    if(rsp->fd != -1){
+        rsp->length = rsp->avail = st.st_size;
+
+        //count the hit, learn files the index doesn't know yet
+        cache_path(rsp->hname, rsp->pname, key);
+        if(!cache_index_hit(rsp->idx, key) && !rsp->gzip){
+            cache_index_put(rsp->idx, key, st.st_size, st.st_mtime, 0);
+        }
+
+        printf("File is given from local filesystem\n");
+        return;
+    }
+
+    //not on disk, drop it from the index if its there
+    cache_path(rsp->hname, rsp->pname, key);
+    cache_index_remove(rsp->idx, key);
+
+    //fetch from origin, while we reply to earlier requests.
+    //with all fetchers busy, fetch it now, the earlier replies wait
+    rsp->hdr_ready = rsp->done = 0;
+    if(__sync_add_and_fetch(&rsp->fetch->busy, 1) <= FETCH_THREADS){
+        rsp->fetching = 1;
+        dispatch(rsp->fetch->tp, fetch_handler, rsp);
+    }else{
+        __sync_sub_and_fetch(&rsp->fetch->busy, 1);
+        cache_file(rsp);
+    }
+}
+
+//Release a reply slot
+static void end_reply(response_t * rsp){
+    //the fetcher may still be closing its upstream socket
+    pthread_mutex_lock(&rsp->lock);
+    while(rsp->fetching){
+        pthread_cond_wait(&rsp->ready, &rsp->lock);
+    }
+    pthread_mutex_unlock(&rsp->lock);
+
+    if(rsp->fd != -1){
+        close(rsp->fd);
+        rsp->fd = -1;
+    }
+    free(rsp->hdrs);
+    rsp->hdrs = NULL;
+    pthread_mutex_destroy(&rsp->lock);
+    pthread_cond_destroy(&rsp->ready);
 }
 
-static int creat_socket(const int port){
-    struct sockaddr_in inaddr;
-    const int opt = 1;
+//Wait for a reply to be ready and send it
+static int send_reply(const int sd, response_t * rsp, io_timer_t * timer){
+    int rv = 0;
+
+    pthread_mutex_lock(&rsp->lock);
+    //HTTP/1.0 clients can't get chunked replies, wait for the length
+    while(!rsp->hdr_ready ||
+          ((rsp->length == -1) && !rsp->http11 && !rsp->done)){
+        pthread_cond_wait(&rsp->ready, &rsp->lock);
+    }
+    const int failed = rsp->done && rsp->failed;
+    pthread_mutex_unlock(&rsp->lock);
+
+    if(rsp->msg != NULL){
+        err_reply(sd, rsp->code, rsp->reason, rsp->msg);
+        rv = -1;
+    }else if(failed){
+        err_reply(sd, 500, "Some server side error", "Some server side error");
+        rv = -1;
+    }else{
+        const int chunked = (rsp->length == -1);
+
+        if(send_hdr_file(sd, rsp, chunked) < 0){
+            rv = -1;
+        }else{
+            const off_t response_bytes = send_body(sd, rsp, chunked, timer);
+            if(response_bytes < 0){
+                rv = -1;
+            }else{
+                printf("Total response bytes: %lu\n", response_bytes);
+            }
+        }
+    }
+
+    end_reply(rsp);
+    return rv;
+}
+
+//Connect a CONNECT request to its server, and hand both sockets to the relay
+static int open_tunnel(const dispatch_t * conn, response_t * rsp, const char * buf, const size_t buf_len){
+    static const char established[] = "HTTP/1.1 200 Connection established\r\n\r\n";
+    char name[NI_MAXHOST + 8];
+
+    errno = 0;
+    const int serv_sd = connect_to(rsp->hname, rsp->port, conn->to);
+    if(serv_sd == -1){
+        if(errno == ETIMEDOUT){
+            err_reply(conn->sd, 504, "Gateway Timeout", "Server did not respond in time");
+        }else{
+            err_reply(conn->sd, 502, "Bad Gateway", "Can't connect to server");
+        }
+        return -1;
+    }
+
+    if(send(conn->sd, established, sizeof(established) - 1, MSG_NOSIGNAL) != sizeof(established) - 1){
+        close(serv_sd);
+        return -1;
+    }
+
+    //client may have sent data right after the request
+    if((buf_len > 0) && (writen(serv_sd, buf, buf_len) != (int) buf_len)){
+        close(serv_sd);
+        return -1;
+    }
 
-    const int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock < 0){
-        perror("socket");
+    //from now on, the relay owns both sockets
+    snprintf(name, sizeof(name), "%s:%s", rsp->hname, rsp->port);
+    relay_tunnel(conn->rl, conn->sd, serv_sd, name);
+
+    return 0;
+}
+
+//Wait for the next request of an idle keep-alive connection.
+//returns 1 when the client sent something or closed, or its deadline shut the socket,
+//0 to close the connection, because other connections are queued for the pool
+static int wait_next_request(const int sd, threadpool * pool){
+    struct pollfd pfd;
+    int wait_ms = 0;    //a request already sent is served, even if others wait
+
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+    while(poll(&pfd, 1, wait_ms) == 0){
+        if(__sync_fetch_and_add(&pool->qsize, 0) > 0){
+            return 0;
+        }
+        wait_ms = KEEPALIVE_CHECK_MS;
+    }
+    return 1;
+}
+
+int proxy_handler(void * arg){
+
+    const dispatch_t conn = *(dispatch_t *) arg;
+    const int sd = conn.sd;
+    io_timer_t timer;
+    free(arg);
+
+    io_timer_init(&timer, sd, conn.to);
+
+    size_t buf_len = 0;
+    char * buf = malloc(sizeof(char)*CONN_BUF_SIZE);
+    response_t * queue = (response_t *) malloc(sizeof(response_t)*PIPELINE_DEPTH);
+    if((buf == NULL) || (queue == NULL)){
+        perror("malloc");
+
+        err_reply(sd, 500, "Some server side error", "Some server side error");
+
+        free(buf);
+        free(queue);
+        shutdown(sd, SHUT_RDWR);
+        close(sd);
         return -1;
     }
 
-    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) != 0){
-        perror("setsockopt");
+    //process client connection
+    int keep_alive = 1, first = 1, tunneled = 0;
+    while(keep_alive){
+        ssize_t n;
+        size_t off = 0, req_len;
+        int i, nrsp = 0;
+
+        //idle between requests, or a started request has to arrive in time
+        const int idle = !first && (buf_len == 0);
+        io_arm(&timer, idle ? TO_KEEPALIVE : TO_HEADER);
+        first = 0;
+
+        //an idle connection holds its worker only while no one else needs it
+        if(idle && (wait_next_request(sd, conn.tp) == 0)){
+            io_disarm(&timer);
+            break;
+        }
+
+        //read until we have at least one full request
+        while(request_end(buf, buf_len) == 0){
+            if(buf_len >= CONN_BUF_SIZE - 1){
+                err_reply(sd, 400, "Bad Request", "Bad Request");
+                keep_alive = 0;
+                break;
+            }
+
+            n = recv(sd, &buf[buf_len], CONN_BUF_SIZE - 1 - buf_len, 0);
+            if(n <= 0){
+                keep_alive = 0;
+                break;
+            }
+            buf_len += n;
+
+            //header deadline doesn't move with each byte
+            if(timer.kind == TO_KEEPALIVE){
+                io_arm(&timer, TO_HEADER);
+            }
+        }
+        io_disarm(&timer);
+        if(!keep_alive){
+            break;
+        }
+
+        //take whatever else client has pipelined, without waiting
+        n = recv(sd, &buf[buf_len], CONN_BUF_SIZE - 1 - buf_len, MSG_DONTWAIT);
+        if(n > 0){
+            buf_len += n;
+        }
+
+        //start every complete request, up to the queue depth
+        while((nrsp < PIPELINE_DEPTH) &&
+              ((req_len = request_end(&buf[off], buf_len - off)) > 0)){
+            response_t * rsp = &queue[nrsp++];
+
+            //end request string temporarily
+            const char c = buf[off + req_len];
+            buf[off + req_len] = '\0';
+            start_response(rsp, &buf[off], req_len, &conn);
+            buf[off + req_len] = c;
+
+            off += req_len;
+
+            //no more requests after an error, or a closing request
+            if((rsp->msg != NULL) || (rsp->keep_alive == 0)){
+                keep_alive = 0;
+                break;
+            }
+        }
+
+        //keep partial requests for next round
+        buf_len -= off;
+        memmove(buf, &buf[off], buf_len);
+
+        //reply in request order
+        for(i=0; i < nrsp; i++){
+
+            //a tunnel is always the last request on a connection
+            if(queue[i].tunnel && (queue[i].msg == NULL)){
+                end_reply(&queue[i]);
+                tunneled = (open_tunnel(&conn, &queue[i], buf, buf_len) == 0);
+                keep_alive = 0;
+                break;
+            }
+
+            if(send_reply(sd, &queue[i], &timer) < 0){
+                keep_alive = 0;
+                break;
+            }
+        }
+
+        //client is gone, clean up the rest
+        for(i = i + 1; i < nrsp; i++){
+            end_reply(&queue[i]);
+        }
+    }
+    free(buf);
+    free(queue);
+
+    //a tunnel keeps the connection
+    if(tunneled){
+        return 0;
+    }
+
+    //close the connection after reply is sent
+    shutdown(sd, SHUT_RDWR);
+    close(sd);
+
+    return 0;
+}
+
+static int check_arguments(struct arguments * arg, const int argc, char * argv[]){
+    const char * usage = "Usage: proxyServer [-c <cache-root>[,<cache-root>...]] "
+                         "[-p <host:port>[,<host:port>...] -s <host:port>] [-r <requests/s>[,<bytes/s>]] "
+                         "<port> <pool-size> <max-number-of-request> <filter>\n";
+    char * root, * peer;
+    int opt, i;
+
+    //cache in the working directory, unless roots are given
+    arg->roots[0]  = ".";
+    arg->num_roots = 1;
+    arg->num_peers = 0;
+    arg->self      = NULL;
+    arg->req_rate  = 0;
+    arg->byte_rate = 0;
+
+    while((opt = getopt(argc, argv, "c:p:s:r:")) != -1){
+        switch(opt){
+        case 'c':
+            //one root per disk, comma separated
+            arg->num_roots = 0;
+            for(root = strtok(optarg, ","); root; root = strtok(NULL, ",")){
+                if(arg->num_roots == MAX_CACHE_DISKS){
+                    fprintf(stderr, "Error: Too many cache roots\n");
+                    return -1;
+                }
+                arg->roots[arg->num_roots++] = root;
+            }
+            break;
+        case 'p':
+            //all proxies sharing the cache, us included
+            for(peer = strtok(optarg, ","); peer; peer = strtok(NULL, ",")){
+                if(arg->num_peers == MAX_PEERS){
+                    fprintf(stderr, "Error: Too many peers\n");
+                    return -1;
+                }
+                arg->peers[arg->num_peers++] = peer;
+            }
+            break;
+        case 's':
+            arg->self = optarg;
+            break;
+        case 'r':
+            //requests per second, and optionally bytes per second
+            arg->req_rate = atof(optarg);
+            if(strchr(optarg, ',')){
+                arg->byte_rate = atof(strchr(optarg, ',') + 1);
+            }
+            if((arg->req_rate < 0) || (arg->byte_rate < 0)){
+                fprintf(stderr, "Error: Invalid rate\n");
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return -1;
+        }
+    }
+
+    //every peer must find itself on the ring
+    if((argc - optind != 4) || (arg->num_roots == 0) ||
+       ((arg->num_peers > 0) != (arg->self != NULL))){
+        fprintf(stderr, "%s", usage);
         return -1;
     }
 
-    bzero(&inaddr, sizeof(struct sockaddr_in));
-    inaddr.sin_family	= AF_INET;
-    inaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    inaddr.sin_port	= htons(port);
+    arg->port         = atoi(argv[optind]);
+    arg->pool_size    = atoi(argv[optind + 1]);
+    arg->max_requests = atoi(argv[optind + 2]);
+    arg->filter       =      argv[optind + 3];
+
+    //check if number arguments are valid
+    if( (arg->port < 0)      || (arg->port > 65535) ||
+        (arg->pool_size < 0) || (arg->pool_size > MAXT_IN_POOL) ||
+        (arg->max_requests < 0)){
+        fprintf(stderr, "Error: Invalid arguments\n");
+    }
 
-    if( bind(sock, (struct sockaddr *) &inaddr, sizeof(struct sockaddr_in)) < 0 ){
-        perror("bind");
+    //check file exists and is readable
+    if(access(arg->filter, R_OK) == -1){
+        perror(arg->filter);
         return -1;
     }
 
+    //cache roots must be directories we can write in
+    for(i=0; i < arg->num_roots; i++){
+        if(access(arg->roots[i], W_OK | X_OK) == -1){
+            perror(arg->roots[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int creat_socket(const int port){
+    struct sockaddr_in6 in6addr;
+    struct sockaddr_in inaddr;
+    const int opt = 1, off = 0;
+    int sock;
+
+    //dual stack socket, takes IPv4 clients as mapped addresses
+    sock = socket(AF_INET6, SOCK_STREAM, 0);
+    if(sock >= 0){
+        if( (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) != 0) ||
+            (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(int)) != 0) ){
+            perror("setsockopt");
+            return -1;
+        }
+
+        bzero(&in6addr, sizeof(struct sockaddr_in6));
+        in6addr.sin6_family = AF_INET6;
+        in6addr.sin6_addr   = in6addr_any;
+        in6addr.sin6_port   = htons(port);
+
+        if( bind(sock, (struct sockaddr *) &in6addr, sizeof(struct sockaddr_in6)) < 0 ){
+            perror("bind");
+            return -1;
+        }
+
+    }else{
+        //no IPv6 on this host
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if(sock < 0){
+            perror("socket");
+            return -1;
+        }
+
+        if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) != 0){
+            perror("setsockopt");
+            return -1;
+        }
+
+        bzero(&inaddr, sizeof(struct sockaddr_in));
+        inaddr.sin_family	= AF_INET;
+        inaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        inaddr.sin_port	= htons(port);
+
+        if( bind(sock, (struct sockaddr *) &inaddr, sizeof(struct sockaddr_in)) < 0 ){
+            perror("bind");
+            return -1;
+        }
+    }
+
     if(listen(sock, 10) < 0){
         perror("listen");
         return -1;
@@ -576,26 +2431,66 @@ static int creat_socket(const int port){
     return sock;
 }
 
-static int accept_socket(const int sock, struct sockaddr_in *inaddr){
-    char ip[INET_ADDRSTRLEN];
-    size_t len = sizeof(struct sockaddr_in);
+static int accept_socket(const int sock, struct sockaddr_storage *inaddr){
+    char ip[NI_MAXHOST], serv[NI_MAXSERV];
+    socklen_t len = sizeof(struct sockaddr_storage);
 
-    const int sd = accept(sock, (struct sockaddr *) inaddr, (socklen_t *) &len);
+    const int sd = accept(sock, (struct sockaddr *) inaddr, &len);
     if(sd < 0){
         perror("accept");
         return -1;
     }
 
-    inet_ntop(AF_INET, &inaddr->sin_addr, ip, INET_ADDRSTRLEN);
-    printf("Peer %s connected on port %d\n", ip, ntohs(inaddr->sin_port));
+    if(getnameinfo((struct sockaddr *) inaddr, len, ip, sizeof(ip), serv, sizeof(serv),
+                   NI_NUMERICHOST | NI_NUMERICSERV) == 0){
+        printf("Peer %s connected on port %s\n", ip, serv);
+    }
 
     return sd;
 }
 
+//Parse a network in address/prefix form, IPv4 or IPv6
+static int parse_net(char * buf, struct net * net){
+    char * s_net = strchr(buf, '/');
+    int i;
+
+    if(s_net){
+        *s_net++ = '\0';
+    }
+
+    if(strchr(buf, ':')){
+        net->family = AF_INET6;
+        net->prefix = 128;
+    }else{
+        net->family = AF_INET;
+        net->prefix = 32;
+    }
+
+    memset(net->addr, 0, sizeof(net->addr));
+    if(inet_pton(net->family, buf, net->addr) != 1){
+        return -1;
+    }
+
+    if(s_net){
+        const int prefix = atoi(s_net);
+        if((prefix < 0) || (prefix > net->prefix)){
+            return -1;
+        }
+        net->prefix = prefix;
+    }
+
+    //drop the unused bits from ip
+    for(i = net->prefix; i < 128; i++){
+        net->addr[i / 8] &= ~(0x80 >> (i % 8));
+    }
+
+    return 0;
+}
+
 static int load_filter(const char * filename, struct filter * filt){
     char buf[NI_MAXHOST];
     size_t hosts_size = 0;
-    size_t ips_size = 0;
+    size_t nets_size = 0;
 
     FILE * fp = fopen(filename, "r");
     if(fp == NULL){
@@ -604,34 +2499,36 @@ static int load_filter(const char * filename, struct filter * filt){
     }
 
     filt->hosts = NULL;
-    filt->ips = NULL;
-    filt->num_hosts = filt->num_ips = 0;
+    filt->nets = NULL;
+    filt->num_hosts = filt->num_nets = 0;
 
     while(fgets(buf, sizeof(buf), fp) != NULL){
 
         size_t len = strlen(buf);
-        if(buf[len-1] == '\n'){
+        if((len > 0) && (buf[len-1] == '\n')){
             buf[--len] = '\0';  //remove newline
         }
 
-        if(buf[len-1] == '\r'){
+        if((len > 0) && (buf[len-1] == '\r')){
             buf[--len] = '\0';  //remove newline
         }
 
-        if(isdigit(buf[0])){
-            if(filt->num_ips >= ips_size){
-                ips_size += 10;
-                filt->ips = realloc(filt->ips, sizeof(char*)*ips_size);
-            }
-            const char * s_ip  = strtok(buf, "/");
-            const char * s_net = strtok(NULL, "/");
-            int ip = (int) inet_addr(s_ip);
-            const int net = 32 - atoi(s_net);
+        if(len == 0){
+            continue;
+        }
 
-            //drop the unused bits from ip
-            ip = (ip >> net) << net;
+        //IPv4 networks start with a digit, IPv6 ones have colons
+        if(isdigit(buf[0]) || strchr(buf, ':')){
+            if(filt->num_nets >= nets_size){
+                nets_size += 10;
+                filt->nets = realloc(filt->nets, sizeof(struct net)*nets_size);
+            }
 
-            filt->ips[filt->num_ips++] = (in_addr_t) ip;
+            if(parse_net(buf, &filt->nets[filt->num_nets]) == -1){
+                fprintf(stderr, "Error: Invalid network in filter: %s\n", buf);
+                continue;
+            }
+            filt->num_nets++;
 
         }else{
             if(filt->num_hosts >= hosts_size){
@@ -652,19 +2549,132 @@ static void free_filters(struct filter * filt){
         free(filt->hosts[i]);
     }
     free(filt->hosts);
-    free(filt->ips);
+    free(filt->nets);
 }
 
 static void sig_handler(int sig){
     return;
 }
 
+//Split a host:port peer name, IPv6 hosts are in brackets ([::1]:8080)
+static int parse_peer(const char * name, struct peer * peer){
+    const char * host = name, * port = strrchr(name, ':');
+    size_t len;
+
+    if((port == NULL) || (atoi(&port[1]) <= 0) || (atoi(&port[1]) > 65535)){
+        return -1;
+    }
+    len = port - host;
+    if((host[0] == '[') && (len >= 2) && (host[len - 1] == ']')){
+        host++;
+        len -= 2;
+    }
+    if((len == 0) || (len >= sizeof(peer->host))){
+        return -1;
+    }
+
+    memcpy(peer->host, host, len);
+    peer->host[len] = '\0';
+    snprintf(peer->port, sizeof(peer->port), "%d", atoi(&port[1]));
+    snprintf(peer->name, sizeof(peer->name), "%s", name);
+    peer->down_until = 0;
+    return 0;
+}
+
+//Resolve the host of a peer, to know its connections
+static void resolve_peer(struct peer * peer){
+    struct addrinfo hints, *result, *rp;
+    int family;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    const int s = getaddrinfo(peer->host, peer->port, &hints, &result);
+    if(s != 0){
+        fprintf(stderr, "Peer %s: getaddrinfo: %s, its requests are limited as a client's\n", peer->name, gai_strerror(s));
+        return;
+    }
+
+    for(rp = result; (rp != NULL) && (peer->num_addrs < MAX_PEER_ADDRS); rp = rp->ai_next){
+        const unsigned char * addr = ip_of(rp->ai_addr, &family);
+        if(addr == NULL){
+            continue;
+        }
+        struct net * net = &peer->addrs[peer->num_addrs++];
+        net->family = family;
+        net->prefix = (family == AF_INET) ? 32 : 128;
+        memset(net->addr, 0, sizeof(net->addr));
+        memcpy(net->addr, addr, net->prefix / 8);
+    }
+    freeaddrinfo(result);
+}
+
+//Set up the peers and their ring, from the command line
+static int load_peers(const struct arguments * arg, struct peers * peers){
+    int i;
+
+    memset(peers, 0, sizeof(struct peers));
+    peers->self = -1;
+
+    peers->list = (struct peer *) calloc(arg->num_peers, sizeof(struct peer));
+    if(peers->list == NULL){
+        perror("malloc");
+        return -1;
+    }
+    peers->num = arg->num_peers;
+
+    for(i=0; i < arg->num_peers; i++){
+        if(parse_peer(arg->peers[i], &peers->list[i]) == -1){
+            fprintf(stderr, "Error: Invalid peer %s\n", arg->peers[i]);
+            free(peers->list);
+            return -1;
+        }
+        if(strcmp(arg->peers[i], arg->self) == 0){
+            peers->self = i;
+        }
+    }
+
+    if(peers->self == -1){
+        fprintf(stderr, "Error: %s is not in the peers\n", arg->self);
+        free(peers->list);
+        return -1;
+    }
+
+    for(i=0; i < arg->num_peers; i++){
+        if(i != peers->self){
+            resolve_peer(&peers->list[i]);
+        }
+    }
+
+    //placed by name, so all peers build the same ring from the same list
+    peers->ring = create_hashring((const char **) arg->peers, arg->num_peers, PEER_VNODES);
+    if(peers->ring == NULL){
+        free(peers->list);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void free_peers(struct peers * peers){
+    printf("Peers: %lu asked, %lu failed\n", peers->asked, peers->failed);
+    destroy_hashring(peers->ring);
+    free(peers->list);
+}
+
+
 int main(const int argc, char * argv[]){
     struct arguments arg;
     threadpool * tp;
     struct filter filt;
+    struct compressor comp;
+    struct fetchers fetch;
+    struct timeouts to;
+    struct peers peers;
     unsigned int nreq = 0;  //number of requests
     struct sigaction sa;
+    int i;
 
     sa.sa_flags = 0;
     sigemptyset(&sa.sa_mask);
@@ -674,6 +2684,12 @@ int main(const int argc, char * argv[]){
         perror("sigaction");
     }
 
+    //sendfile and splice to a client that went away can't be told MSG_NOSIGNAL
+    sa.sa_handler = SIG_IGN;
+    if(sigaction(SIGPIPE, &sa, NULL) == -1){
+        perror("sigaction");
+    }
+
     if(check_arguments(&arg, argc, argv) < 0){
         return EXIT_FAILURE;
     }
@@ -682,11 +2698,80 @@ int main(const int argc, char * argv[]){
         return EXIT_FAILURE;
     }
 
-    tp = create_threadpool(arg.pool_size);
+    if((arg.num_peers > 0) && (load_peers(&arg, &peers) == -1)){
+        return EXIT_FAILURE;
+    }
+
+    //connections of each client take turns for the threads
+    tp = create_fair_threadpool(arg.pool_size, POOL_QUANTUM_US);
     if(tp == NULL){
         return EXIT_FAILURE;
     }
 
+    ratelimit * limits = NULL;
+    if((arg.req_rate > 0) || (arg.byte_rate > 0)){
+        //a bucket holds at least one request, and one buffer of a reply,
+        //else low rates would refuse every request, or pace every send
+        const double req_burst = arg.req_rate * REQ_BURST_SECS;
+        const double byte_burst = arg.byte_rate * BYTE_BURST_SECS;
+        const rl_limit client = {
+            arg.req_rate, (req_burst < 1) ? 1 : req_burst,
+            arg.byte_rate, (byte_burst < COPY_BUF_SIZE) ? COPY_BUF_SIZE : byte_burst
+        };
+        const rl_limit net = {
+            client.req_rate * NET_CLIENTS, client.req_burst * NET_CLIENTS,
+            client.byte_rate * NET_CLIENTS, client.byte_burst * NET_CLIENTS
+        };
+        limits = create_ratelimit(&client, &net, LIMIT_IDLE_SECS);
+        if(limits == NULL){
+            return EXIT_FAILURE;
+        }
+    }
+
+    comp.pending = 0;
+    comp.tp = create_threadpool(GZIP_THREADS);
+    if(comp.tp == NULL){
+        return EXIT_FAILURE;
+    }
+
+    fetch.busy = 0;
+    fetch.tp = create_threadpool(FETCH_THREADS);
+    if(fetch.tp == NULL){
+        return EXIT_FAILURE;
+    }
+
+    memset(&to, 0, sizeof(to));
+    to.tw = create_timerwheel(TIMER_TICK_MS);
+    if(to.tw == NULL){
+        return EXIT_FAILURE;
+    }
+
+    relay * rl = create_relay(to.tw, TUNNEL_IDLE_TIMEOUT);
+    if(rl == NULL){
+        return EXIT_FAILURE;
+    }
+
+    cache_disks * disks = create_cache_disks(arg.roots, arg.num_roots, DISK_IO_THREADS);
+    if(disks == NULL){
+        return EXIT_FAILURE;
+    }
+
+    //load what we know about the cache, or rebuild it without delaying accept,
+    //each disk is scanned by its own workers
+    cache_index * idx = create_cache_index(INDEX_FILE, INDEX_CHECKPOINT_SECS);
+    if(idx == NULL){
+        return EXIT_FAILURE;
+    }
+    if(cache_index_load(idx) == -1){
+        const char * roots[MAX_CACHE_DISKS];
+        threadpool * pools[MAX_CACHE_DISKS];
+        for(i=0; i < disks->num_disks; i++){
+            roots[i] = disks->disks[i].root;
+            pools[i] = disks->disks[i].io;
+        }
+        cache_index_scan(idx, roots, pools, disks->num_disks);
+    }
+
     const int sock = creat_socket(arg.port);
     if(sock == -1){
         return EXIT_FAILURE;
@@ -694,7 +2779,7 @@ int main(const int argc, char * argv[]){
 
     while(nreq++ < arg.max_requests){
         //wait for a connection
-        struct sockaddr_in inaddr;
+        struct sockaddr_storage inaddr;
         const int sd = accept_socket(sock, &inaddr);
         if(sd == -1){
             break;
@@ -709,15 +2794,54 @@ int main(const int argc, char * argv[]){
         data->sd = sd;
         data->filt = &filt;
         data->inaddr = inaddr;
-
-        dispatch(tp, proxy_handler, data);
+        data->comp = &comp;
+        data->fetch = &fetch;
+        data->to = &to;
+        data->rl = rl;
+        data->idx = idx;
+        data->disks = disks;
+        data->peers = (arg.num_peers > 0) ? &peers : NULL;
+        data->tp = tp;
+
+        data->limits = limits;
+
+        dispatch_keyed(tp, proxy_handler, data, ratelimit_client_key(&inaddr));
     }
 
     shutdown(sock, SHUT_RDWR);
     close(sock);
 
+    //connections wait for their fetches, so fetchers go after them
     destroy_threadpool(tp);
+    destroy_threadpool(fetch.tp);
+    destroy_threadpool(comp.tp);
+    destroy_relay(rl);
+    destroy_timerwheel(to.tw);
+
+    size_t entries;
+    uint64_t bytes;
+    cache_index_stats(idx, &entries, &bytes);
+    printf("Cache index: %lu entries, %lu bytes\n", entries, bytes);
+    destroy_cache_index(idx);
+
+    //after the index, its scan runs on the disk workers
+    destroy_cache_disks(disks);
+
+    //report expired deadlines
+    for(i=0; i < TO_KINDS; i++){
+        printf("Timeouts %s: %lu\n", timeout_names[i], to.expired[i]);
+    }
 
+    if(arg.num_peers > 0){
+        free_peers(&peers);
+    }
+    if(limits){
+        size_t clients;
+        unsigned long limited;
+        ratelimit_stats(limits, &clients, &limited);
+        printf("Rate limits: %lu buckets, %lu requests refused\n", clients, limited);
+        destroy_ratelimit(limits);
+    }
     free_filters(&filt);
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "ratelimit.h"
+
+//network of a client, its buckets are shared by all the clients in it
+#define RL_NET4_PREFIX 24
+#define RL_NET6_PREFIX 64
+
+static long rl_now_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * get the address of a client, IPv4 mapped addresses as IPv4.
+ * returns its prefix length, or -1 if it's not an IP address.
+ */
+static int rl_client_addr(const struct sockaddr_storage* ss, int* family, unsigned char addr[16]){
+  memset(addr, 0, 16);
+
+  if(ss->ss_family == AF_INET){
+    const struct sockaddr_in* in = (const struct sockaddr_in*) ss;
+    *family = AF_INET;
+    memcpy(addr, &in->sin_addr, 4);
+    return 32;
+  }
+
+  if(ss->ss_family == AF_INET6){
+    const struct sockaddr_in6* in6 = (const struct sockaddr_in6*) ss;
+    if(IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)){
+      *family = AF_INET;
+      memcpy(addr, &in6->sin6_addr.s6_addr[12], 4);
+      return 32;
+    }
+    *family = AF_INET6;
+    memcpy(addr, &in6->sin6_addr, 16);
+    return 128;
+  }
+
+  return -1;
+}
+
+//clear the host bits of an address
+static void rl_mask(unsigned char addr[16], const int prefix){
+  int i;
+  for(i=0; i < 16; i++){
+    const int bits = prefix - i * 8;
+    if(bits <= 0){
+      addr[i] = 0;
+    }else if(bits < 8){
+      addr[i] &= (unsigned char) (0xff << (8 - bits));
+    }
+  }
+}
+
+static int rl_net_prefix(const int family){
+  return (family == AF_INET) ? RL_NET4_PREFIX : RL_NET6_PREFIX;
+}
+
+static uint64_t rl_hash(const int family, const int prefix, const unsigned char addr[16]){
+  uint64_t h = 14695981039346656037ULL;  //FNV-1a
+  int i;
+
+  h = (h ^ (unsigned) family) * 1099511628211ULL;
+  h = (h ^ (unsigned) prefix) * 1099511628211ULL;
+  for(i=0; i < 16; i++){
+    h = (h ^ addr[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static const rl_limit* rl_limit_of(ratelimit* rl, const rl_entry* e){
+  const int host = (e->family == AF_INET) ? 32 : 128;
+  return (e->prefix == host) ? &rl->client : &rl->net;
+}
+
+static double rl_fill(const double tokens, const double rate, const double burst, const long ms){
+  const double t = tokens + rate * ms / 1000.0;
+  return (t > burst) ? burst : t;
+}
+
+/**
+ * an entry can be dropped once idle with full buckets,
+ * it would be created the same on next use.
+ */
+static int rl_expired(ratelimit* rl, const rl_entry* e, const long now){
+  const rl_limit* lim = rl_limit_of(rl, e);
+  const long ms = now - e->last_ms;
+
+  return (ms >= rl->idle_ms) &&
+         ((lim->req_rate <= 0) || (rl_fill(e->req_tokens, lim->req_rate, lim->req_burst, ms) >= lim->req_burst)) &&
+         ((lim->byte_rate <= 0) || (rl_fill(e->byte_tokens, lim->byte_rate, lim->byte_burst, ms) >= lim->byte_burst));
+}
+
+/**
+ * drop the expired entries of a chain, except keep.
+ * called with the shard locked.
+ */
+static void rl_expire(ratelimit* rl, rl_shard* sh, rl_entry** pe, const rl_entry* keep, const long now){
+  while(*pe){
+    rl_entry* e = *pe;
+    if((e != keep) && rl_expired(rl, e, now)){
+      *pe = e->next;
+      sh->num_entries--;
+      free(e);
+    }else{
+      pe = &e->next;
+    }
+  }
+}
+
+/**
+ * take tokens from the buckets of an address, refunded if reqs is negative.
+ * returns 0 if there are not enough request tokens, else 1 and the
+ * time to wait for the bytes in wait_ms.
+ */
+static int rl_take(ratelimit* rl, const rl_limit* lim, const int family, const int prefix,
+                   const unsigned char addr[16], const double reqs, const double bytes, long* wait_ms){
+  const long now = rl_now_ms();
+  const uint64_t hash = rl_hash(family, prefix, addr);
+  rl_shard* sh = &rl->shards[hash % RL_SHARDS];
+  rl_entry** chain = &sh->chains[(hash / RL_SHARDS) % RL_CHAINS];
+  rl_entry* e;
+  int ok = 1;
+
+  //nothing to count
+  if((lim->req_rate <= 0) && (lim->byte_rate <= 0)){
+    return 1;
+  }
+
+  pthread_mutex_lock(&sh->lock);
+
+  for(e = *chain; e; e = e->next){
+    if((e->hash == hash) && (e->family == family) && (e->prefix == prefix) &&
+       (memcmp(e->addr, addr, 16) == 0)){
+      break;
+    }
+  }
+
+  if(e == NULL){
+    e = (rl_entry*) calloc(1, sizeof(rl_entry));
+    if(e == NULL){
+      perror("malloc");
+      pthread_mutex_unlock(&sh->lock);
+      return 1;   //don't refuse clients for our own failure
+    }
+    e->family = family;
+    e->prefix = prefix;
+    memcpy(e->addr, addr, 16);
+    e->hash = hash;
+    e->req_tokens = lim->req_burst;
+    e->byte_tokens = lim->byte_burst;
+    e->last_ms = now;
+    e->next = *chain;
+    *chain = e;
+    sh->num_entries++;
+
+    //new entries pay for sweeping a chain, so idle ones don't pile up
+    rl_expire(rl, sh, &sh->chains[sh->sweep], e, now);
+    sh->sweep = (sh->sweep + 1) % RL_CHAINS;
+  }else{
+    rl_expire(rl, sh, chain, e, now);
+  }
+
+  //refill for the time since last use
+  const long ms = now - e->last_ms;
+  e->req_tokens = rl_fill(e->req_tokens, lim->req_rate, lim->req_burst, ms);
+  e->byte_tokens = rl_fill(e->byte_tokens, lim->byte_rate, lim->byte_burst, ms);
+  e->last_ms = now;
+
+  if(lim->req_rate > 0){
+    if(reqs < 0){
+      e->req_tokens = rl_fill(e->req_tokens - reqs, 0, lim->req_burst, 0);
+    }else if(e->req_tokens < reqs){
+      ok = 0;
+    }else{
+      e->req_tokens -= reqs;
+    }
+  }
+
+  //with no bytes, only tells how long the debt takes to pay off
+  if(ok && (lim->byte_rate > 0)){
+    e->byte_tokens -= bytes;
+    if(e->byte_tokens < 0){
+      const long wait = (long) (-e->byte_tokens * 1000.0 / lim->byte_rate);
+      if(wait > *wait_ms){
+        *wait_ms = wait;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&sh->lock);
+  return ok;
+}
+
+/**
+ * create_ratelimit creates an empty table.
+ */
+ratelimit* create_ratelimit(const rl_limit* client, const rl_limit* net, int idle_secs){
+  int i;
+
+  ratelimit* rl = (ratelimit*) calloc(1, sizeof(ratelimit));
+  if(rl == NULL){
+    perror("malloc");
+    return NULL;
+  }
+
+  rl->client = *client;
+  rl->net = *net;
+  rl->idle_ms = idle_secs * 1000;
+
+  for(i=0; i < RL_SHARDS; i++){
+    if(pthread_mutex_init(&rl->shards[i].lock, NULL) != 0){
+      perror("pthread_mutex_init");
+      free(rl);
+      return NULL;
+    }
+  }
+
+  return rl;
+}
+
+int ratelimit_request(ratelimit* rl, const struct sockaddr_storage* addr){
+  unsigned char a[16];
+  int family;
+  long wait = 0;
+
+  const int prefix = rl_client_addr(addr, &family, a);
+  if(prefix == -1){
+    return 1;
+  }
+
+  if(!rl_take(rl, &rl->client, family, prefix, a, 1, 0, &wait)){
+    __sync_add_and_fetch(&rl->limited, 1);
+    return 0;
+  }
+
+  rl_mask(a, rl_net_prefix(family));
+  if(!rl_take(rl, &rl->net, family, rl_net_prefix(family), a, 1, 0, &wait)){
+    //the client keeps its token
+    rl_client_addr(addr, &family, a);
+    rl_take(rl, &rl->client, family, prefix, a, -1, 0, &wait);
+    __sync_add_and_fetch(&rl->limited, 1);
+    return 0;
+  }
+
+  return 1;
+}
+
+long ratelimit_bytes(ratelimit* rl, const struct sockaddr_storage* addr, size_t bytes){
+  unsigned char a[16];
+  int family;
+  long wait = 0;
+
+  const int prefix = rl_client_addr(addr, &family, a);
+  if(prefix == -1){
+    return 0;
+  }
+
+  rl_take(rl, &rl->client, family, prefix, a, 0, bytes, &wait);
+  rl_mask(a, rl_net_prefix(family));
+  rl_take(rl, &rl->net, family, rl_net_prefix(family), a, 0, bytes, &wait);
+
+  return wait;
+}
+
+uint64_t ratelimit_client_key(const struct sockaddr_storage* addr){
+  unsigned char a[16];
+  int family;
+
+  const int prefix = rl_client_addr(addr, &family, a);
+  return (prefix == -1) ? 0 : rl_hash(family, prefix, a);
+}
+
+void ratelimit_stats(ratelimit* rl, size_t* entries, unsigned long* limited){
+  int i;
+
+  *entries = 0;
+  for(i=0; i < RL_SHARDS; i++){
+    pthread_mutex_lock(&rl->shards[i].lock);
+    *entries += rl->shards[i].num_entries;
+    pthread_mutex_unlock(&rl->shards[i].lock);
+  }
+  *limited = rl->limited;
+}
+
+/**
+ * destroy_ratelimit frees the table.
+ */
+void destroy_ratelimit(ratelimit* rl){
+  int i, j;
+
+  for(i=0; i < RL_SHARDS; i++){
+    rl_shard* sh = &rl->shards[i];
+    for(j=0; j < RL_CHAINS; j++){
+      rl_entry* e = sh->chains[j];
+      while(e){
+        rl_entry* next = e->next;
+        free(e);
+        e = next;
+      }
+    }
+    pthread_mutex_destroy(&sh->lock);
+  }
+  free(rl);
+}
@@ -0,0 +1,83 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+//the table is split in shards, each with its own lock
+#define RL_SHARDS 64
+#define RL_CHAINS 256
+
+//rates are per second, 0 for no limit
+typedef struct rl_limit_st {
+  double req_rate, req_burst;
+  double byte_rate, byte_burst;
+} rl_limit;
+
+//token buckets of a client, or of a network of clients
+typedef struct rl_entry_st {
+  int family;
+  int prefix;             //128 or 32 for a client, less for a network
+  unsigned char addr[16];
+  uint64_t hash;
+  double req_tokens;
+  double byte_tokens;     //negative while a send is paced
+  long last_ms;           //buckets refilled up to then
+  struct rl_entry_st * next;
+} rl_entry;
+
+typedef struct rl_shard_st {
+  pthread_mutex_t lock;
+  rl_entry * chains[RL_CHAINS];
+  size_t num_entries;
+  int sweep;              //next chain to expire idle entries in
+} rl_shard;
+
+typedef struct ratelimit_st {
+  rl_shard shards[RL_SHARDS];
+  rl_limit client;        //each client address
+  rl_limit net;           //each /24 (IPv4) or /64 (IPv6)
+  int idle_ms;            //idle entries are dropped after this
+  unsigned long limited;  //requests refused
+} ratelimit;
+
+/**
+ * create_ratelimit creates an empty table, with the limits of each
+ * client and of each network. entries idle for idle_secs, with full
+ * buckets, are dropped as the table is used.
+ * returns NULL on failure.
+ */
+ratelimit* create_ratelimit(const rl_limit* client, const rl_limit* net, int idle_secs);
+
+/**
+ * ratelimit_request takes a request token from the client and its network.
+ * returns 1 if the request can go on, 0 if one of them is over its limit.
+ */
+int ratelimit_request(ratelimit* rl, const struct sockaddr_storage* addr);
+
+/**
+ * ratelimit_bytes takes bytes from the client and its network,
+ * they may go in debt.
+ * returns how long to wait before sending more, in milliseconds,
+ * until both are out of debt. 0 bytes just checks the debt.
+ */
+long ratelimit_bytes(ratelimit* rl, const struct sockaddr_storage* addr, size_t bytes);
+
+/**
+ * ratelimit_client_key hashes a client address, an IPv4 mapped
+ * address is the same client as its IPv4 address.
+ */
+uint64_t ratelimit_client_key(const struct sockaddr_storage* addr);
+
+/**
+ * ratelimit_stats counts the entries and refused requests.
+ */
+void ratelimit_stats(ratelimit* rl, size_t* entries, unsigned long* limited);
+
+/**
+ * destroy_ratelimit frees the table.
+ */
+void destroy_ratelimit(ratelimit* rl);
+
+#endif
@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "relay.h"
+
+//max bytes moved by one splice call
+#define SPLICE_LEN (64*1024)
+#define MAX_EVENTS 64
+
+/**
+ * idle timer expired, shut both sockets down.
+ * the loop sees the hangup and closes the tunnel.
+ */
+static void tunnel_idle(void* arg){
+  tunnel* t = (tunnel*) arg;
+  shutdown(t->end[0].fd, SHUT_RDWR);
+  shutdown(t->end[1].fd, SHUT_RDWR);
+}
+
+/**
+ * release a tunnel and print its accounting.
+ * called from the loop thread.
+ */
+static void tunnel_close(relay* r, tunnel* t){
+  struct timespec now;
+  int i;
+
+  //timer must not fire on closed fds
+  timer_cancel(r->tw, &t->idle);
+
+  for(i=0; i < 2; i++){
+    close(t->end[i].fd);
+    close(t->end[i].pipe[0]);
+    close(t->end[i].pipe[1]);
+  }
+
+  if(t->prev){
+    t->prev->next = t->next;
+  }else{
+    r->active = t->next;
+  }
+  if(t->next){
+    t->next->prev = t->prev;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const double secs = (now.tv_sec - t->start.tv_sec) +
+                      (now.tv_nsec - t->start.tv_nsec) / 1e9;
+
+  printf("Tunnel %s closed: %lu bytes up, %lu bytes down, %.3f s\n",
+         t->name, t->end[0].bytes, t->end[1].bytes, secs);
+
+  r->tunnels++;
+  r->bytes_up += t->end[0].bytes;
+  r->bytes_down += t->end[1].bytes;
+
+  free(t);
+}
+
+/**
+ * move all we can from one side to the other, through the pipe.
+ * returns 1 if bytes moved, 0 if nothing to do, -1 on error.
+ */
+static int tunnel_pump(tunnel_end* from, tunnel_end* to){
+  int moved = 0;
+  ssize_t n;
+
+  while(1){
+    //first empty the pipe into the other side
+    if(from->in_pipe > 0){
+      n = splice(from->pipe[0], NULL, to->fd, NULL, from->in_pipe,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if(n > 0){
+        from->in_pipe -= n;
+        from->bytes += n;
+        moved = 1;
+        continue;
+      }
+      if((n == -1) && (errno == EAGAIN)){
+        break;  //other side is full, wait for EPOLLOUT
+      }
+      return -1;
+    }
+
+    if(from->eof){
+      break;
+    }
+
+    //pipe is empty, fill it from socket
+    n = splice(from->fd, NULL, from->pipe[1], NULL, SPLICE_LEN,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0){
+      from->in_pipe += n;
+      moved = 1;
+    }else if(n == 0){
+      //pass the half close to the other side
+      from->eof = 1;
+      shutdown(to->fd, SHUT_WR);
+      moved = 1;
+    }else if(errno == EAGAIN){
+      break;
+    }else{
+      return -1;
+    }
+  }
+
+  return moved;
+}
+
+/**
+ * register a handed off tunnel with epoll.
+ * called from the loop thread.
+ */
+static void tunnel_add(relay* r, tunnel* t){
+  struct epoll_event ev;
+  int i;
+
+  t->prev = NULL;
+  t->next = r->active;
+  if(r->active){
+    r->active->prev = t;
+  }
+  r->active = t;
+
+  for(i=0; i < 2; i++){
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &t->end[i];
+    if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, t->end[i].fd, &ev) == -1){
+      perror("epoll_ctl");
+      tunnel_close(r, t);
+      return;
+    }
+  }
+
+  timer_add(r->tw, &t->idle, r->idle_ms, tunnel_idle, t);
+}
+
+/**
+ * The work function of the loop thread
+ */
+static void* relay_work(void* p){
+  relay* r = (relay*) p;
+  struct epoll_event events[MAX_EVENTS];
+  int i;
+
+  while(1){
+    const int n = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+    if(n == -1){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("epoll_wait");
+      break;
+    }
+
+    for(i=0; i < n; i++){
+      //event of a tunnel closed in this batch
+      if(events[i].data.ptr == NULL){
+        continue;
+      }
+
+      //new tunnels, or shutdown
+      if(events[i].data.ptr == r){
+        uint64_t val;
+        if(read(r->evfd, &val, sizeof(val)) == -1){
+          perror("read");
+        }
+
+        pthread_mutex_lock(&r->lock);
+        tunnel* list = r->pending;
+        r->pending = NULL;
+        const int shutdown = r->shutdown;
+        pthread_mutex_unlock(&r->lock);
+
+        while(list){
+          tunnel* t = list;
+          list = list->next;
+          tunnel_add(r, t);
+        }
+
+        if(shutdown){
+          goto out;
+        }
+        continue;
+      }
+
+      tunnel_end* e = (tunnel_end*) events[i].data.ptr;
+      tunnel* t = e->tun;
+
+      //an event on either side may unblock both directions
+      const int up   = tunnel_pump(&t->end[0], &t->end[1]);
+      const int down = tunnel_pump(&t->end[1], &t->end[0]);
+
+      if((up == -1) || (down == -1) ||
+         ((t->end[0].eof && t->end[0].in_pipe == 0) &&
+          (t->end[1].eof && t->end[1].in_pipe == 0)) ){
+        tunnel_close(r, t);
+        //skip later events of this tunnel in the same batch
+        int j;
+        for(j=i+1; j < n; j++){
+          if((events[j].data.ptr != r) && (events[j].data.ptr != NULL) &&
+             (((tunnel_end*) events[j].data.ptr)->tun == t)){
+            events[j].data.ptr = NULL;
+          }
+        }
+      }else if(up || down){
+        timer_add(r->tw, &t->idle, r->idle_ms, tunnel_idle, t);
+      }
+    }
+  }
+
+out:
+  //close whatever is still open
+  while(r->active){
+    tunnel_close(r, r->active);
+  }
+  return NULL;
+}
+
+/**
+ * create_relay creates the tunnel event loop and starts its thread.
+ */
+relay* create_relay(timerwheel* tw, int idle_ms){
+  struct epoll_event ev;
+
+  relay* r = (relay*) calloc(1, sizeof(relay));
+  if(r == NULL){
+    perror("malloc");
+    return NULL;
+  }
+  r->tw = tw;
+  r->idle_ms = idle_ms;
+
+  r->epfd = epoll_create1(0);
+  r->evfd = eventfd(0, EFD_NONBLOCK);
+  if((r->epfd == -1) || (r->evfd == -1)){
+    perror("epoll_create1");
+    free(r);
+    return NULL;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = r;
+  if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->evfd, &ev) == -1){
+    perror("epoll_ctl");
+    free(r);
+    return NULL;
+  }
+
+  if(pthread_mutex_init(&r->lock, NULL) != 0){
+    perror("pthread_mutex_init");
+    free(r);
+    return NULL;
+  }
+
+  if(pthread_create(&r->thread, NULL, relay_work, (void*)r) != 0){
+    perror("pthread_create");
+    free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+/**
+ * relay_tunnel hands a connected client and server socket to the loop.
+ */
+int relay_tunnel(relay* r, int client_sd, int server_sd, const char* name){
+  const uint64_t one = 1;
+  int i;
+
+  tunnel* t = (tunnel*) calloc(1, sizeof(tunnel));
+  if(t == NULL){
+    perror("malloc");
+    close(client_sd);
+    close(server_sd);
+    return -1;
+  }
+
+  snprintf(t->name, sizeof(t->name), "%s", name);
+  clock_gettime(CLOCK_MONOTONIC, &t->start);
+  t->r = r;
+  t->end[0].fd = client_sd;
+  t->end[1].fd = server_sd;
+
+  for(i=0; i < 2; i++){
+    t->end[i].tun = t;
+
+    if(pipe2(t->end[i].pipe, O_NONBLOCK) == -1){
+      perror("pipe2");
+      if(i == 1){
+        close(t->end[0].pipe[0]);
+        close(t->end[0].pipe[1]);
+      }
+      close(client_sd);
+      close(server_sd);
+      free(t);
+      return -1;
+    }
+
+    const int flags = fcntl(t->end[i].fd, F_GETFL);
+    fcntl(t->end[i].fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  //loop thread takes it from here
+  pthread_mutex_lock(&r->lock);
+  t->next = r->pending;
+  r->pending = t;
+  pthread_mutex_unlock(&r->lock);
+
+  if(write(r->evfd, &one, sizeof(one)) == -1){
+    perror("write");
+  }
+
+  return 0;
+}
+
+/**
+ * destroy_relay stops the loop thread, closes open tunnels
+ * and frees the relay.
+ */
+void destroy_relay(relay* r){
+  const uint64_t one = 1;
+
+  pthread_mutex_lock(&r->lock);
+  r->shutdown = 1;
+  pthread_mutex_unlock(&r->lock);
+
+  if(write(r->evfd, &one, sizeof(one)) == -1){
+    perror("write");
+  }
+  pthread_join(r->thread, NULL);
+
+  printf("Tunnels: %lu, %lu bytes up, %lu bytes down\n",
+         r->tunnels, r->bytes_up, r->bytes_down);
+
+  close(r->epfd);
+  close(r->evfd);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
@@ -0,0 +1,67 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <pthread.h>
+#include <time.h>
+#include "timerwheel.h"
+
+/**
+ * one side of a tunnel, bytes read from fd go to the other side
+ * through the pipe.
+ */
+typedef struct tunnel_end_st {
+  struct tunnel_st * tun;
+  int fd;
+  int pipe[2];            //read end, write end
+  size_t in_pipe;         //bytes read, not written yet
+  unsigned long bytes;    //bytes relayed to the other side
+  int eof;                //fd has no more data
+} tunnel_end;
+
+typedef struct tunnel_st {
+  tunnel_end end[2];      //client, server
+  char name[128];         //host:port, for logging
+  struct timespec start;
+  tw_timer idle;
+  struct relay_st * r;
+  struct tunnel_st *next, *prev;
+} tunnel;
+
+typedef struct relay_st {
+  int epfd;
+  int evfd;               //wakes the loop for new tunnels and shutdown
+  pthread_t thread;
+  pthread_mutex_t lock;
+  tunnel * pending;       //handed off, not registered yet
+  tunnel * active;        //owned by the loop thread
+  int shutdown;
+  timerwheel * tw;
+  int idle_ms;
+
+  //accounting of all closed tunnels
+  unsigned long tunnels;
+  unsigned long bytes_up, bytes_down;
+} relay;
+
+/**
+ * create_relay creates the tunnel event loop and starts its thread.
+ * tunnels with no traffic for idle_ms are closed.
+ * returns NULL on failure.
+ */
+relay* create_relay(timerwheel* tw, int idle_ms);
+
+/**
+ * relay_tunnel hands a connected client and server socket to the loop,
+ * which relays bytes both ways until both sides are done.
+ * the loop owns and closes both sockets, even on failure.
+ * returns 0 on success, -1 on failure.
+ */
+int relay_tunnel(relay* r, int client_sd, int server_sd, const char* name);
+
+/**
+ * destroy_relay stops the loop thread, closes open tunnels
+ * and frees the relay.
+ */
+void destroy_relay(relay* r);
+
+#endif
@@ -1,7 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <time.h>
 #include "threadpool.h"
 
+//buckets of the flow table of a fair pool
+#define FLOW_BUCKETS 256
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -39,7 +44,7 @@ threadpool* create_threadpool(int num_threads_in_pool){
   }
 
   if( (pthread_cond_init(&tp->q_not_empty, NULL) != 0) ||
-      (pthread_cond_init(&tp->q_not_empty, NULL) != 0) ){
+      (pthread_cond_init(&tp->q_empty, NULL) != 0) ){
     perror("pthread_cond_init");
     return NULL;
   }
@@ -56,6 +61,160 @@ threadpool* create_threadpool(int num_threads_in_pool){
   return tp;
 }
 
+/**
+ * create_fair_threadpool creates a pool whose jobs are queued by key,
+ * keys take turns in deficit round robin.
+ */
+threadpool* create_fair_threadpool(int num_threads_in_pool, long quantum_us){
+
+  if(quantum_us <= 0){
+    fprintf(stderr, "Error: Invalid pool quantum\n");
+    return NULL;
+  }
+
+  flow_t ** flows = (flow_t **) calloc(FLOW_BUCKETS, sizeof(flow_t*));
+  if(flows == NULL){
+    perror("malloc");
+    return NULL;
+  }
+
+  threadpool* tp = create_threadpool(num_threads_in_pool);
+  if(tp == NULL){
+    free(flows);
+    return NULL;
+  }
+
+  //no job is queued yet, threads only look at these under the lock
+  pthread_mutex_lock(&tp->qlock);
+  tp->fair = 1;
+  tp->quantum_us = quantum_us;
+  tp->flows = flows;
+  pthread_mutex_unlock(&tp->qlock);
+
+  return tp;
+}
+
+/**
+ * find the flow of a key, or start one.
+ * called with the queue locked.
+ */
+static flow_t* flow_get(threadpool* tp, unsigned long key){
+  flow_t ** pf = &tp->flows[key % FLOW_BUCKETS];
+  flow_t * f;
+
+  for(f = *pf; f; f = f->next){
+    if(f->key == key){
+      return f;
+    }
+  }
+
+  f = (flow_t*) calloc(1, sizeof(flow_t));
+  if(f == NULL){
+    perror("malloc");
+    return NULL;
+  }
+  f->key = key;
+  f->deficit = tp->quantum_us;  //a new flow goes on its first turn
+  f->next = *pf;
+  *pf = f;
+
+  return f;
+}
+
+/**
+ * free a flow with no jobs left.
+ * called with the queue locked.
+ */
+static void flow_put(threadpool* tp, flow_t* f){
+  flow_t ** pf = &tp->flows[f->key % FLOW_BUCKETS];
+
+  if(f->running || f->qhead || f->active){
+    return;
+  }
+
+  while(*pf != f){
+    pf = &(*pf)->next;
+  }
+  *pf = f->next;
+  free(f);
+}
+
+//add a flow at the end of the round
+static void round_add(threadpool* tp, flow_t* f){
+  f->rr_next = NULL;
+  if(tp->rr_tail){
+    tp->rr_tail->rr_next = f;
+  }else{
+    tp->rr_head = f;
+  }
+  tp->rr_tail = f;
+}
+
+/**
+ * take the next job in deficit round robin: on its turn, a flow in
+ * credit runs one job, a flow in debt gets a quantum and waits for
+ * its next turn. jobs are charged their real run time when done.
+ * called with the queue locked, and a job queued.
+ */
+static work_t* fair_take(threadpool* tp){
+  int visits = 0;
+
+  while(1){
+    flow_t * f = tp->rr_head;
+    tp->rr_head = f->rr_next;
+    if(tp->rr_head == NULL){
+      tp->rr_tail = NULL;
+    }
+
+    if(f->deficit > 0){
+      work_t * work = f->qhead;
+      f->qhead = work->next;
+      if(f->qhead == NULL){
+        f->qtail = NULL;
+      }
+      f->running++;
+
+      //charge a quantum up front, settled when the job is done
+      f->deficit -= tp->quantum_us;
+
+      if(f->qhead){
+        round_add(tp, f);
+      }else{
+        f->active = 0;
+        tp->num_active--;
+      }
+      return work;
+    }
+
+    f->deficit += tp->quantum_us;
+    round_add(tp, f);
+
+    //a whole round and all are in debt, skip the rounds
+    //until the first of them is in credit
+    if(++visits == tp->num_active){
+      long rounds = LONG_MAX;
+      flow_t * g;
+
+      for(g = tp->rr_head; g; g = g->rr_next){
+        const long r = (g->deficit > 0) ? 0 : -g->deficit / tp->quantum_us;
+        if(r < rounds){
+          rounds = r;
+        }
+      }
+      for(g = tp->rr_head; g; g = g->rr_next){
+        g->deficit += rounds * tp->quantum_us;
+      }
+      visits = 0;
+    }
+  }
+}
+
+static long now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -64,6 +223,13 @@ threadpool* create_threadpool(int num_threads_in_pool){
  * this function should:
  */
 void dispatch(threadpool* tp, dispatch_fn dispatch_to_here, void *arg){
+  dispatch_keyed(tp, dispatch_to_here, arg, 0);
+}
+
+/**
+ * dispatch_keyed is dispatch, with the key the job is accounted to.
+ */
+void dispatch_keyed(threadpool* tp, dispatch_fn dispatch_to_here, void *arg, unsigned long key){
 
   //1. create and init work_t element
   work_t * work = (work_t*) malloc(sizeof(work_t));
@@ -74,6 +240,7 @@ void dispatch(threadpool* tp, dispatch_fn dispatch_to_here, void *arg){
 
   work->routine = dispatch_to_here;
   work->arg = arg;
+  work->flow = NULL;
   work->next = NULL;
 
   // 2. lock the mutex
@@ -85,8 +252,29 @@ void dispatch(threadpool* tp, dispatch_fn dispatch_to_here, void *arg){
     return;
   }
 
-  //3. add the work_t element to the queue
-  if(tp->qsize == 0){
+  //3. add the work_t element to the queue, or to its flow in a fair pool
+  if(tp->fair){
+    flow_t * f = flow_get(tp, key);
+    if(f == NULL){
+      free(work);
+      pthread_mutex_unlock(&tp->qlock);
+      return;
+    }
+    work->flow = f;
+
+    if(f->qhead == NULL){
+      f->qhead = f->qtail = work;
+    }else{
+      f->qtail->next = work;
+      f->qtail = work;
+    }
+
+    if(!f->active){
+      f->active = 1;
+      tp->num_active++;
+      round_add(tp, f);
+    }
+  }else if(tp->qsize == 0){
     tp->qhead = tp->qtail = work;
   }else {
     tp->qtail->next = work;
@@ -130,11 +318,18 @@ void* do_work(void* p){
       break;
     }
 
-    //3. take the first element from the queue (work_t)
-    work_t * work = tp->qhead;
-    tp->qhead = tp->qhead->next;
-    if(--tp->qsize == 0){
-      tp->qtail = NULL;
+    //3. take the first element from the queue (work_t),
+    //or the next one in turn in a fair pool
+    work_t * work;
+    if(tp->fair){
+      work = fair_take(tp);
+      --tp->qsize;
+    }else{
+      work = tp->qhead;
+      tp->qhead = tp->qhead->next;
+      if(--tp->qsize == 0){
+        tp->qtail = NULL;
+      }
     }
 
     //if queue is empty and destruction process in place
@@ -146,8 +341,20 @@ void* do_work(void* p){
     pthread_mutex_unlock(&tp->qlock);
 
     //5. call the thread routine
+    const long start = work->flow ? now_us() : 0;
     work->routine(work->arg);
 
+    //settle the flow's charge with the time the job really took
+    if(work->flow){
+      const long used = now_us() - start;
+
+      pthread_mutex_lock(&tp->qlock);
+      work->flow->deficit -= used - tp->quantum_us;
+      work->flow->running--;
+      flow_put(tp, work->flow);
+      pthread_mutex_unlock(&tp->qlock);
+    }
+
     free(work);
   }
 
@@ -189,6 +396,16 @@ void destroy_threadpool(threadpool* tp){
   pthread_mutex_destroy(&tp->qlock);
 
   //release resources
+  if(tp->flows){
+    for(i=0; i < FLOW_BUCKETS; i++){
+      while(tp->flows[i]){
+        flow_t * f = tp->flows[i];
+        tp->flows[i] = f->next;
+        free(f);
+      }
+    }
+    free(tp->flows);
+  }
   free(tp->threads);
   free(tp);
 
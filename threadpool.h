@@ -0,0 +1,113 @@
+/**
+ * threadpool.h
+ *
+ * This file declares the functionality associated with
+ * your implementation of a threadpool.
+ */
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <pthread.h>
+
+// maximum number of threads allowed in a pool
+#define MAXT_IN_POOL 200
+
+// "dispatch_fn" declares a typed function pointer.  A
+// variable of type "dispatch_fn" points to a function
+// with the following signature:
+//
+//     int dispatch_function(void *arg);
+typedef int (*dispatch_fn)(void *);
+
+/**
+ * work_t: a job in the queue, the function to call and its argument.
+ */
+typedef struct work_st{
+  int (*routine) (void*);
+  void * arg;
+  struct flow_st * flow;    //owner in a fair pool, NULL otherwise
+  struct work_st* next;
+} work_t;
+
+/**
+ * flow_t: the jobs of one key (a client) in a fair pool.
+ * flows take turns, a flow that used more pool time than the
+ * others waits until they caught up (deficit round robin).
+ */
+typedef struct flow_st{
+  unsigned long key;
+  work_t * qhead;           //jobs of this flow, in order
+  work_t * qtail;
+  long deficit;             //pool time it may still use, in microseconds
+  int running;              //jobs taken, not done yet
+  int active;               //in the round
+  struct flow_st * next;    //in the flow table
+  struct flow_st * rr_next; //in the round
+} flow_t;
+
+/**
+ * threadpool: the threads and the queue of jobs.
+ * the queue is a FIFO, or in a fair pool, the round of flows.
+ */
+typedef struct _threadpool_st {
+  int num_threads;          //number of active threads
+  int qsize;                //number in the queue
+  pthread_t *threads;       //pointer to threads
+  work_t* qhead;            //queue head pointer
+  work_t* qtail;            //queue tail pointer
+  pthread_mutex_t qlock;    //lock on the queue list
+  pthread_cond_t q_not_empty; //signaled when a job is queued
+  pthread_cond_t q_empty;   //signaled when the queue drains
+  int shutdown;             //1 if the pool is being destroyed
+  int dont_accept;          //1 if destroy function has begun
+
+  //deficit round robin admission, only in a fair pool
+  int fair;
+  long quantum_us;          //pool time a flow gets each round
+  flow_t ** flows;          //flow table, by key
+  flow_t * rr_head;         //flows with jobs, in turn order
+  flow_t * rr_tail;
+  int num_active;           //flows in the round
+} threadpool;
+
+/**
+ * create_threadpool creates a fixed-sized thread
+ * pool.  If the function succeeds, it returns a (non-NULL)
+ * "threadpool", else it returns NULL.
+ */
+threadpool* create_threadpool(int num_threads_in_pool);
+
+/**
+ * create_fair_threadpool creates a pool whose jobs are queued by key.
+ * when jobs wait, keys take turns, and each gets about the same
+ * pool time, quantum_us at a time.
+ */
+threadpool* create_fair_threadpool(int num_threads_in_pool, long quantum_us);
+
+/**
+ * dispatch enter a "job" of type work_t into the queue.
+ * when an available thread takes a job from the queue, it will
+ * call the function "dispatch_to_here" with argument "arg".
+ */
+void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_keyed is dispatch, with the key the job is accounted to
+ * in a fair pool. in other pools it's the same as dispatch.
+ */
+void dispatch_keyed(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, unsigned long key);
+
+/**
+ * The work function of the thread
+ */
+void* do_work(void* p);
+
+/**
+ * destroy_threadpool kills the threadpool, causing
+ * all threads in it to commit suicide, and then
+ * frees all the memory associated with the threadpool.
+ */
+void destroy_threadpool(threadpool* destroyme);
+
+#endif
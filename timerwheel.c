@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include "timerwheel.h"
+
+static void list_init(tw_timer* head){
+  head->next = head->prev = head;
+}
+
+static void list_add(tw_timer* head, tw_timer* t){
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void list_del(tw_timer* t){
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+/**
+ * put the timer in the slot of the level its expiry falls in.
+ * called with the wheel locked.
+ */
+static void wheel_insert(timerwheel* tw, tw_timer* t){
+  long delta = (long) (t->expires - tw->now);
+  int level;
+
+  //already late, run on next tick
+  if(delta < 0){
+    list_add(&tw->wheel[0][tw->now & TW_MASK], t);
+    return;
+  }
+
+  for(level=0; level < TW_LEVELS - 1; level++){
+    if(delta < (1L << (TW_BITS * (level + 1)))){
+      break;
+    }
+  }
+
+  //beyond the last level, park in the furthest slot
+  if(delta >= (1L << (TW_BITS * TW_LEVELS))){
+    t->expires = tw->now + (1L << (TW_BITS * TW_LEVELS)) - 1;
+  }
+
+  const int slot = (t->expires >> (TW_BITS * level)) & TW_MASK;
+  list_add(&tw->wheel[level][slot], t);
+}
+
+/**
+ * move the timers of a coarse slot to the finer levels.
+ */
+static void wheel_cascade(timerwheel* tw, const int level, const int slot){
+  tw_timer list;
+  tw_timer* head = &tw->wheel[level][slot];
+
+  if(head->next == head){
+    return;
+  }
+
+  //take the whole list, then re-insert each timer
+  list.next = head->next;
+  list.prev = head->prev;
+  list.next->prev = list.prev->next = &list;
+  list_init(head);
+
+  while(list.next != &list){
+    tw_timer* t = list.next;
+    list_del(t);
+    wheel_insert(tw, t);
+  }
+}
+
+/**
+ * run one tick: cascade coarse levels, then fire the current slot.
+ * called with the wheel locked.
+ */
+static void wheel_tick(timerwheel* tw){
+  const int idx = tw->now & TW_MASK;
+  int level;
+
+  //at the start of a round, bring down the next coarse slot
+  if(idx == 0){
+    for(level=1; level < TW_LEVELS; level++){
+      const int slot = (tw->now >> (TW_BITS * level)) & TW_MASK;
+      wheel_cascade(tw, level, slot);
+      if(slot != 0){
+        break;
+      }
+    }
+  }
+
+  tw_timer* head = &tw->wheel[0][idx];
+  while(head->next != head){
+    tw_timer* t = head->next;
+    list_del(t);
+    t->pending = 0;
+    t->fn(t->arg);
+  }
+
+  tw->now++;
+}
+
+/**
+ * The work function of the wheel thread
+ */
+static void* wheel_work(void* p){
+  timerwheel* tw = (timerwheel*) p;
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while(1){
+    //sleep to the next tick, on absolute time so ticks don't drift
+    next.tv_nsec += tw->tick_ms * 1000000L;
+    while(next.tv_nsec >= 1000000000L){
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+    pthread_mutex_lock(&tw->lock);
+    if(tw->shutdown){
+      pthread_mutex_unlock(&tw->lock);
+      break;
+    }
+    wheel_tick(tw);
+    pthread_mutex_unlock(&tw->lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * create_timerwheel creates a timer wheel with a tick
+ * of tick_ms milliseconds, and starts its thread.
+ */
+timerwheel* create_timerwheel(int tick_ms){
+  int i, j;
+
+  if(tick_ms <= 0){
+    fprintf(stderr, "Error: Invalid timer tick\n");
+    return NULL;
+  }
+
+  timerwheel* tw = (timerwheel*) calloc(1, sizeof(timerwheel));
+  if(tw == NULL){
+    perror("malloc");
+    return NULL;
+  }
+  tw->tick_ms = tick_ms;
+
+  for(i=0; i < TW_LEVELS; i++){
+    for(j=0; j < TW_SLOTS; j++){
+      list_init(&tw->wheel[i][j]);
+    }
+  }
+
+  if(pthread_mutex_init(&tw->lock, NULL) != 0){
+    perror("pthread_mutex_init");
+    free(tw);
+    return NULL;
+  }
+
+  if(pthread_create(&tw->thread, NULL, wheel_work, (void*)tw) != 0){
+    perror("pthread_create");
+    pthread_mutex_destroy(&tw->lock);
+    free(tw);
+    return NULL;
+  }
+
+  return tw;
+}
+
+/**
+ * timer_add arms the timer to call fn(arg) after timeout_ms.
+ */
+void timer_add(timerwheel* tw, tw_timer* t, int timeout_ms, timer_fn fn, void* arg){
+  //round up, a timer never fires early
+  const unsigned long ticks = (timeout_ms + tw->tick_ms - 1) / tw->tick_ms;
+
+  pthread_mutex_lock(&tw->lock);
+
+  if(t->pending){
+    list_del(t);
+  }
+  t->fn = fn;
+  t->arg = arg;
+  t->expires = tw->now + ticks;
+  t->pending = 1;
+  wheel_insert(tw, t);
+
+  pthread_mutex_unlock(&tw->lock);
+}
+
+/**
+ * timer_cancel disarms the timer.
+ */
+int timer_cancel(timerwheel* tw, tw_timer* t){
+  int was_pending;
+
+  pthread_mutex_lock(&tw->lock);
+
+  was_pending = t->pending;
+  if(t->pending){
+    list_del(t);
+    t->pending = 0;
+  }
+
+  pthread_mutex_unlock(&tw->lock);
+
+  return was_pending;
+}
+
+/**
+ * destroy_timerwheel stops the wheel thread and frees the wheel.
+ */
+void destroy_timerwheel(timerwheel* tw){
+
+  pthread_mutex_lock(&tw->lock);
+  tw->shutdown = 1;
+  pthread_mutex_unlock(&tw->lock);
+
+  pthread_join(tw->thread, NULL);
+
+  pthread_mutex_destroy(&tw->lock);
+  free(tw);
+}
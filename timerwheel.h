@@ -0,0 +1,63 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <pthread.h>
+
+//wheel geometry: 4 levels of 64 slots, each level 64 times coarser
+#define TW_BITS   6
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_MASK   (TW_SLOTS - 1)
+#define TW_LEVELS 4
+
+typedef void (*timer_fn)(void *);
+
+/**
+ * a timer, embedded in the user's structure.
+ * it must stay valid while it's pending.
+ */
+typedef struct tw_timer_st {
+  struct tw_timer_st *next, *prev;
+  unsigned long expires;  //tick to fire on
+  timer_fn fn;
+  void * arg;
+  int pending;
+} tw_timer;
+
+typedef struct timerwheel_st {
+  int tick_ms;
+  unsigned long now;      //next tick to run
+  tw_timer wheel[TW_LEVELS][TW_SLOTS];  //list heads
+  pthread_mutex_t lock;
+  pthread_t thread;
+  int shutdown;
+} timerwheel;
+
+/**
+ * create_timerwheel creates a timer wheel with a tick
+ * of tick_ms milliseconds, and starts its thread.
+ * returns NULL on failure.
+ */
+timerwheel* create_timerwheel(int tick_ms);
+
+/**
+ * timer_add arms the timer to call fn(arg) after timeout_ms.
+ * a pending timer is re-armed. O(1).
+ * fn is called from the wheel thread, with the wheel locked,
+ * so it must be short and can't use the wheel.
+ */
+void timer_add(timerwheel* tw, tw_timer* t, int timeout_ms, timer_fn fn, void* arg);
+
+/**
+ * timer_cancel disarms the timer. O(1).
+ * returns 1 if it was pending, 0 if it already fired or was not armed.
+ * after it returns, fn won't be called.
+ */
+int timer_cancel(timerwheel* tw, tw_timer* t);
+
+/**
+ * destroy_timerwheel stops the wheel thread and frees the wheel.
+ * pending timers don't fire.
+ */
+void destroy_timerwheel(timerwheel* tw);
+
+#endif